@@ -28,19 +28,26 @@
 #include <linux/pci.h>
 #include <linux/delay.h>
 #include <linux/interrupt.h>
-#include <linux/kthread.h>
 #include <linux/kernel.h>
 #include <linux/io.h>
 #include <linux/sched.h>
 #include <linux/version.h>
 #include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include <linux/hdreg.h>
+#include <linux/aer.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
 #include <scsi/scsi.h>
 #include <scsi/scsi_ioctl.h>
 #include <scsi/sg.h>
 #include <scsi/scsi_cmnd.h>
 #include <linux/freezer.h>
 #include <linux/uio.h>
+#include <linux/ctype.h>
+#include <linux/crc-t10dif.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 
 #include "sop_kernel_compat.h"
 #include "sop.h"
@@ -73,20 +80,34 @@ static int size_kernel_mem, size_lsgl_mem, size_pci_mem;
 
 static DEFINE_SPINLOCK(dev_list_lock);
 static LIST_HEAD(dev_list);
-static struct task_struct *sop_thread;
 
 static int sop_get_disk_params(struct sop_device *h);
 static int sop_add_disk(struct sop_device *h);
 static void sop_remove_disk(struct sop_device *h);
-static int sop_thread_proc(void *data);
-static int sop_add_timeout(struct queue_info *q, uint timeout);
-static void sop_rem_timeout(struct queue_info *q, uint tmo_slot);
+static void sop_timer_wq(struct work_struct *work);
+static void sop_arm_timer(struct sop_device *h);
+static void sop_add_timeout(struct queue_info *q, struct sop_request *r,
+			    u32 msecs);
+static void sop_rem_timeout(struct queue_info *q, struct sop_request *r);
+static void sop_init_timeout(struct sop_timeout *tmo);
+static void sop_recovery_done(struct sop_device *h, struct sop_request *r);
+static void sop_recovery_wq(struct work_struct *work);
+static void sop_revalidate_wq(struct work_struct *work);
+static void sop_scrub_wq(struct work_struct *work);
 static void sop_fail_all_outstanding_io(struct sop_device *h);
 static void sop_resubmit_wait_list(struct queue_info *qinfo,
 	int (*bio_process)(struct sop_device *h, struct bio *bio,
 			   struct queue_info *qinfo));
 static int sop_process_bio(struct sop_device *h, struct bio *bio,
 			   struct queue_info *qinfo);
+static void sop_complete_pt(struct sop_device *h, struct queue_info *q,
+			    struct sop_request *r);
+static int sop_pt_register(struct sop_device *h);
+static void sop_pt_kill_files(struct sop_device *h);
+static void sop_pt_drain_files(struct sop_device *h);
+static void sop_free_device(struct kref *ref);
+static struct sop_request_pool *sop_qinfo_pool(struct queue_info *q);
+static void sop_mgmt_wake(struct sop_device *h, struct queue_info *q);
 
 #ifdef CONFIG_COMPAT
 static int sop_compat_ioctl(struct block_device *dev, fmode_t mode,
@@ -128,6 +149,9 @@ static struct pci_error_handlers sop_pci_error_handlers = {
 #define SOP_DBG_LVL_DUMP_SENSE		0x0008
 static u32 sop_dbg_lvl, sop_dbg_cmd;
 
+/* Opt-in: send all-zero write bios as WRITE SAME instead of zeroes */
+static u32 sop_zero_detect;
+
 #define SCSI_LUN_IN_PROCESS_OF_BECOMING_READY 0x0401
 
 #ifdef SOP_SUPPORT_BIO_LOG
@@ -337,6 +361,53 @@ static void sop_update_io_counters(struct sop_device *h,
 #define	SOP_UPDATE_SGIO_COUNT(h)
 #endif
 
+/* Wait list residency of all queues, log2 usec buckets */
+static int sop_print_wait_hist(struct sop_device *h, char *buf)
+{
+	char line[SOP_MAX_LINE_LEN];
+	u32 hist[SOP_WAIT_HIST_BUCKETS];
+	int i, b, len;
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 1; i < h->nr_queue_pairs; i++)
+		for (b = 0; b < SOP_WAIT_HIST_BUCKETS; b++)
+			hist[b] += h->qinfo[i].wait_hist[b];
+
+	len = scnprintf(line, SOP_MAX_LINE_LEN, "  Wait usec:");
+	for (b = 0; b < SOP_WAIT_HIST_BUCKETS - 1; b++)
+		if (hist[b])
+			len += scnprintf(line + len, SOP_MAX_LINE_LEN - len,
+				" <%lu:%u", 1UL << b, hist[b]);
+	if (hist[b])
+		len += scnprintf(line + len, SOP_MAX_LINE_LEN - len,
+			" >=%lu:%u", 1UL << (b - 1), hist[b]);
+	len += scnprintf(line + len, SOP_MAX_LINE_LEN - len, "\n");
+	strcat(buf, line);
+
+	return len;
+}
+
+static void sop_reset_wait_hist(void)
+{
+	struct sop_device *h;
+	int i;
+
+	list_for_each_entry(h, &dev_list, node)
+		for (i = 1; i < h->nr_queue_pairs; i++)
+			memset(h->qinfo[i].wait_hist, 0,
+				sizeof(h->qinfo[i].wait_hist));
+}
+
+static void sop_reset_zero_counters(void)
+{
+	struct sop_device *h;
+
+	list_for_each_entry(h, &dev_list, node) {
+		atomic_set(&h->zero_writes, 0);
+		atomic64_set(&h->zero_bytes_elided, 0);
+	}
+}
+
 static ssize_t sop_sysfs_show_debug(struct device_driver *dd, char *buf)
 {
 	ssize_t	size;
@@ -358,7 +429,17 @@ static ssize_t sop_sysfs_show_debug(struct device_driver *dd, char *buf)
 				atomic_read(&h->cmd_pending),
 				h->max_cmd_pending);
 		strcat(buf, line);
+		size += snprintf(line, SOP_MAX_LINE_LEN,
+				"  PCI error recoveries %u, last %u ms\n",
+				h->aer_recoveries, h->aer_last_msecs);
+		strcat(buf, line);
+		size += snprintf(line, SOP_MAX_LINE_LEN,
+				"  Zero writes %d, bytes elided %lld\n",
+				atomic_read(&h->zero_writes),
+				(long long) atomic64_read(&h->zero_bytes_elided));
+		strcat(buf, line);
 		size += sop_print_io_counters(h, buf);
+		size += sop_print_wait_hist(h, buf);
 
 		for (i = 1; i < h->nr_queue_pairs; i++) {
 			size += snprintf(line, SOP_MAX_LINE_LEN,
@@ -367,8 +448,9 @@ static ssize_t sop_sysfs_show_debug(struct device_driver *dd, char *buf)
 				h->qinfo[i].max_qdepth);
 			strcat(buf, line);
 			size += snprintf(line, SOP_MAX_LINE_LEN,
-				"Wait %d, pool[%d]\n",
+				"Wait %d, Limit %d, pool[%d]\n",
 				h->qinfo[i].waitlist_depth,
+				h->qinfo[i].depth_limit,
 				h->qinfo[i].numa_node);
 			strcat(buf, line);
 		}
@@ -387,8 +469,11 @@ static ssize_t sop_sysfs_set_debug(struct device_driver *dd, const char *buf,
 		pr_err("sop: Not a valid command number in \'%s\'.\n", buf);
 		retval = -EINVAL;
 	}
-	if (sop_dbg_cmd == 0)
+	if (sop_dbg_cmd == 0) {
 		sop_reset_io_counters();
+		sop_reset_wait_hist();
+		sop_reset_zero_counters();
+	}
 
 	return retval;
 }
@@ -413,10 +498,30 @@ static ssize_t sop_sysfs_set_dbg_lvl(struct device_driver *dd, const char *buf,
 	return retval;
 }
 
+static ssize_t sop_sysfs_show_zero_detect(struct device_driver *dd,
+					  char *buf)
+{
+	return snprintf(buf, SOP_MAX_LINE_LEN, "%u\n", sop_zero_detect);
+}
+
+static ssize_t sop_sysfs_set_zero_detect(struct device_driver *dd,
+					 const char *buf, size_t count)
+{
+	int retval = count;
+
+	if (sscanf(buf, "%u", &sop_zero_detect) < 1) {
+		pr_err("sop: could not set zero_detect from \'%s\'\n", buf);
+		retval = -EINVAL;
+	}
+	return retval;
+}
+
 static DRIVER_ATTR(debug, S_IRUGO|S_IWUSR, sop_sysfs_show_debug,
 		sop_sysfs_set_debug);
 static DRIVER_ATTR(dbg_lvl, S_IRUGO|S_IWUSR, sop_sysfs_show_dbg_lvl,
 		sop_sysfs_set_dbg_lvl);
+static DRIVER_ATTR(zero_detect, S_IRUGO|S_IWUSR, sop_sysfs_show_zero_detect,
+		sop_sysfs_set_zero_detect);
 
 /*
  * 32-bit readq and writeq implementations taken from old
@@ -553,7 +658,7 @@ static void free_sgl_area(struct sop_device *h, struct sop_request_pool *p)
 static int allocate_pool_request_buffers(struct sop_request_pool *p, int nsgl,
 				      int nbuffers, int node)
 {
-	int size;
+	int size, i;
 
 	BUG_ON(nbuffers > MAX_IO_CMDS);
 	p->numa_node = node;
@@ -571,9 +676,11 @@ static int allocate_pool_request_buffers(struct sop_request_pool *p, int nsgl,
 		goto bailout;
 	memset(p->request, 0, size);
 	size_kernel_mem += size;
+	for (i = 0; i < nbuffers; i++) {
+		INIT_LIST_HEAD(&p->request[i].tmo_entry);
+		INIT_LIST_HEAD(&p->request[i].recovery_entry);
+	}
 	if (nsgl) {
-		int i;
-
 		for (i = 0; i < nbuffers; i++) {
 			p->request[i].sgl = kmalloc_node(nsgl *
 				sizeof(struct scatterlist), GFP_KERNEL, node);
@@ -693,9 +800,9 @@ static void pqi_pool_buffer_free(struct sop_device *h,
 }
 
 static int pqi_ioq_pool_alloc(struct sop_device *h, struct sop_request_pool *p,
-			      int node)
+			      int ncmds, int node)
 {
-	if (allocate_pool_request_buffers(p, MAX_SGLS, MAX_IO_CMDS, node)) {
+	if (allocate_pool_request_buffers(p, MAX_SGLS, ncmds, node)) {
 		dev_warn(&h->pdev->dev, "Failed to alloc rq buffers\n");
 		goto bailout_iq;
 	}
@@ -1392,6 +1499,162 @@ static void free_request(struct sop_device *h, struct sop_request_pool *p,
 
 static void sop_queue_cmd(struct queue_info *qinfo, struct bio *bio);
 
+/* Account count bios entering the wait list, at its tail or head */
+static void sop_wait_enter(struct queue_info *qinfo, u32 count, int at_head)
+{
+	struct sop_wait_run *run;
+	int idx;
+
+	if (!count)
+		return;
+
+	if (qinfo->wait_run_cnt == SOP_WAIT_RUNS) {
+		/* Ring full: coalesce with the run at that end */
+		if (at_head)
+			idx = qinfo->wait_run_head;
+		else
+			idx = (qinfo->wait_run_head + SOP_WAIT_RUNS - 1) %
+				SOP_WAIT_RUNS;
+		qinfo->wait_runs[idx].count += count;
+		return;
+	}
+
+	if (at_head) {
+		qinfo->wait_run_head = (qinfo->wait_run_head +
+					SOP_WAIT_RUNS - 1) % SOP_WAIT_RUNS;
+		idx = qinfo->wait_run_head;
+	} else {
+		idx = (qinfo->wait_run_head + qinfo->wait_run_cnt) %
+			SOP_WAIT_RUNS;
+	}
+	qinfo->wait_run_cnt++;
+	run = &qinfo->wait_runs[idx];
+	run->enq_ns = ktime_to_ns(ktime_get());
+	run->count = count;
+}
+
+/* The bio at the head of the wait list left it */
+static void sop_wait_exit(struct queue_info *qinfo)
+{
+	struct sop_wait_run *run;
+	u64 waited;
+
+	if (!qinfo->wait_run_cnt)
+		return;
+
+	run = &qinfo->wait_runs[qinfo->wait_run_head];
+	waited = div_u64(ktime_to_ns(ktime_get()) - run->enq_ns,
+				NSEC_PER_USEC);
+	qinfo->wait_hist[min_t(int, fls64(waited),
+				SOP_WAIT_HIST_BUCKETS - 1)]++;
+	if (--run->count == 0) {
+		qinfo->wait_run_head = (qinfo->wait_run_head + 1) %
+					SOP_WAIT_RUNS;
+		qinfo->wait_run_cnt--;
+	}
+}
+
+/*
+ * Arm the drain safety net, called with iq->qlock held.  Only needed
+ * with nothing outstanding on the queue: otherwise the interrupt that
+ * completes a command kicks the wait list anyway.
+ */
+static void sop_arm_drain(struct queue_info *qinfo)
+{
+	if (qinfo->drain_armed || SOP_DEVICE_BUSY(qinfo->h) ||
+	    atomic_read(&qinfo->cur_qdepth))
+		return;
+
+	qinfo->drain_armed = 1;
+	hrtimer_start(&qinfo->drain_timer,
+		ns_to_ktime((u64) SOP_DRAIN_DELAY_US * NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+}
+
+/* Room may have opened up: resubmit whatever is waiting */
+static void sop_kick_wait_list(struct queue_info *qinfo)
+{
+	if (bio_list_empty(&qinfo->wait_list) || SOP_DEVICE_BUSY(qinfo->h))
+		return;
+
+	sop_resubmit_wait_list(qinfo, sop_process_bio);
+}
+
+/* A request ID of the node's pool was freed, any of its queues may go */
+static void sop_kick_node_wait_lists(struct sop_device *h, int node)
+{
+	int i;
+
+	for (i = 1; i < h->nr_queue_pairs; i++)
+		if (h->qinfo[i].numa_node == node)
+			sop_kick_wait_list(&h->qinfo[i]);
+}
+
+static enum hrtimer_restart sop_drain_timer_fn(struct hrtimer *timer)
+{
+	struct queue_info *qinfo;
+	unsigned long flags;
+
+	qinfo = container_of(timer, struct queue_info, drain_timer);
+	spin_lock_irqsave(&qinfo->iq->qlock, flags);
+	qinfo->drain_armed = 0;
+	spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
+
+	sop_kick_wait_list(qinfo);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * A SYNCHRONIZE CACHE that goes back to be sent again hands its riders
+ * back too, so whichever sync goes out next covers them.  Called with
+ * iq->qlock held.
+ */
+static void sop_flush_takeback(struct queue_info *q, struct sop_request *r)
+{
+	if (!r->flush)
+		return;
+	bio_list_merge_head(&q->flush_wait, &r->flush_riders);
+	bio_list_init(&r->flush_riders);
+	r->flush = 0;
+	q->flush_busy = 0;
+}
+
+/*
+ * The SYNCHRONIZE CACHE of r is done.  Riders without data complete,
+ * those with data go on to write it.  A flush that gathered meanwhile
+ * is queued to lead the next sync, which picks up the rest of them.
+ */
+static void sop_end_flush(struct sop_device *h, struct queue_info *q,
+			  struct sop_request *r, int result)
+{
+	struct bio_list done;
+	struct bio *bio;
+	unsigned long flags;
+
+	bio_list_init(&done);
+	spin_lock_irqsave(&q->iq->qlock, flags);
+	while ((bio = bio_list_pop(&r->flush_riders))) {
+		if (bio->bi_size && !result) {
+			bio->bi_rw &= ~REQ_FLUSH;
+			sop_queue_cmd(q, bio);
+		} else
+			bio_list_add(&done, bio);
+	}
+	r->flush = 0;
+	q->flush_busy = 0;
+	bio = bio_list_pop(&q->flush_wait);
+	if (bio)
+		sop_queue_cmd(q, bio);
+	spin_unlock_irqrestore(&q->iq->qlock, flags);
+
+	/* bi_end_io may submit more I/O, so not under the queue lock */
+	while ((bio = bio_list_pop(&done))) {
+		atomic_dec(&h->bio_count);
+		bio_endio(bio, result);
+	}
+}
+
 static void retry_sop_request(struct sop_device *h, struct queue_info *qinfo,
 				struct sop_request *r)
 {
@@ -1399,12 +1662,154 @@ static void retry_sop_request(struct sop_device *h, struct queue_info *qinfo,
 	unsigned long flags;
 
 	bio = r->bio;
-	free_request(h, &h->io_req[qinfo->numa_node], r->request_id);
 	spin_lock_irqsave(&qinfo->iq->qlock, flags);
+	sop_flush_takeback(qinfo, r);
+	free_request(h, &h->io_req[qinfo->numa_node], r->request_id);
 	sop_queue_cmd(qinfo, bio);
 	spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
 }
 
+static void sop_retry_end_io(struct bio *clone, int err)
+{
+	struct sop_retry_bio *rb = clone->bi_private;
+	struct bio *bio = rb->orig;
+
+	bio->bi_size = clone->bi_size;
+	bio_put(clone);
+	kfree(rb);
+	bio_endio(bio, err);
+}
+
+/*
+ * A retried bio goes around as a clone that carries its retry count,
+ * since a new request starts from zero.  NULL once it is out of retries.
+ * Should the clone not be had, the bio goes around uncounted this time.
+ */
+static struct bio *sop_retry_bio(struct bio *bio)
+{
+	struct sop_retry_bio *rb;
+	struct bio *clone;
+
+	if (bio->bi_end_io == sop_retry_end_io) {
+		rb = bio->bi_private;
+		if (++rb->retries > MAX_RETRY_COUNT)
+			return NULL;
+		return bio;
+	}
+
+	rb = kmalloc(sizeof(*rb), GFP_ATOMIC);
+	if (!rb)
+		return bio;
+	clone = bio_clone(bio, GFP_ATOMIC);
+	if (!clone) {
+		kfree(rb);
+		return bio;
+	}
+	rb->orig = bio;
+	rb->retries = 1;
+	clone->bi_private = rb;
+	clone->bi_end_io = sop_retry_end_io;
+	return clone;
+}
+
+/*
+ * Park the bio for a retry after a backoff that doubles for as long as
+ * the device keeps asking for retries, instead of resubmitting at once.
+ * Returns -EIO, leaving r as it was, once the bio has run out of retries.
+ */
+static int sop_retry_later(struct sop_device *h, struct queue_info *qinfo,
+				struct sop_request *r)
+{
+	struct bio *bio;
+	unsigned long flags;
+	u32 backoff;
+
+	bio = sop_retry_bio(r->bio);
+	if (!bio) {
+		if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
+			dev_warn(&h->pdev->dev,
+				"Q[%d] rqid %d out of retries\n",
+				qinfo_to_qid(qinfo), r->request_id);
+		return -EIO;
+	}
+
+	spin_lock_irqsave(&qinfo->iq->qlock, flags);
+	sop_flush_takeback(qinfo, r);
+	free_request(h, &h->io_req[qinfo->numa_node], r->request_id);
+	bio_list_add(&qinfo->retry_list, bio);
+	if (!qinfo->retry_armed) {
+		backoff = qinfo->retry_backoff_us * 2;
+		qinfo->retry_backoff_us = clamp_t(u32, backoff,
+						SOP_RETRY_MIN_BACKOFF_US,
+						SOP_RETRY_MAX_BACKOFF_US);
+		qinfo->retry_armed = 1;
+		hrtimer_start(&qinfo->retry_timer,
+			ns_to_ktime((u64) qinfo->retry_backoff_us *
+					NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
+	return 0;
+}
+
+/* Move parked retries to the head of the wait list */
+static void sop_flush_retry_list(struct queue_info *qinfo)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&qinfo->iq->qlock, flags);
+	qinfo->retry_armed = 0;
+	sop_wait_enter(qinfo, bio_list_size(&qinfo->retry_list), 1);
+	qinfo->waitlist_depth += bio_list_size(&qinfo->retry_list);
+	bio_list_merge_head(&qinfo->wait_list, &qinfo->retry_list);
+	bio_list_init(&qinfo->retry_list);
+	spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
+}
+
+static enum hrtimer_restart sop_retry_timer_fn(struct hrtimer *timer)
+{
+	struct queue_info *qinfo;
+
+	qinfo = container_of(timer, struct queue_info, retry_timer);
+	sop_flush_retry_list(qinfo);
+	sop_kick_wait_list(qinfo);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * AIMD window: halve the number of commands kept outstanding on the
+ * queue when the device is busy or its task set is full, and open it
+ * by one again for every window's worth of good completions.
+ */
+static void sop_depth_shrink(struct queue_info *qinfo)
+{
+	qinfo->depth_limit = max_t(u16, qinfo->depth_limit / 2,
+					SOP_MIN_DEPTH_LIMIT);
+	qinfo->depth_credit = 0;
+	if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
+		dev_warn(&qinfo->h->pdev->dev, "Q[%d] depth limit now %d\n",
+			qinfo_to_qid(qinfo), qinfo->depth_limit);
+}
+
+static void sop_depth_grow(struct queue_info *qinfo)
+{
+	unsigned long flags;
+
+	if (unlikely(qinfo->retry_backoff_us)) {
+		spin_lock_irqsave(&qinfo->iq->qlock, flags);
+		qinfo->retry_backoff_us = 0;
+		spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
+	}
+
+	if (qinfo->depth_limit >= qinfo->h->elements_per_io_queue)
+		return;
+	if (++qinfo->depth_credit >= qinfo->depth_limit) {
+		qinfo->depth_limit++;
+		qinfo->depth_credit = 0;
+	}
+}
+
 static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 				struct sop_request *r)
 {
@@ -1417,7 +1822,7 @@ static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 	struct scatterlist *sgl;
 	int result;
 
-	sop_rem_timeout(qinfo, r->tmo_slot);
+	sop_rem_timeout(qinfo, r);
 	sop_end_io_acct(r->bio, r->start_time);
 	sgl = r->sgl;
 
@@ -1433,10 +1838,19 @@ static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 	switch (r->response[0]) {
 	case SOP_RESPONSE_CMD_SUCCESS_IU_TYPE:
 		/* No error to process */
+		sop_depth_grow(qinfo);
 		break;
 
 	case SOP_RESPONSE_CMD_RESPONSE_IU_TYPE:
 		scr = (struct sop_cmd_response *) r->response;
+		if (unlikely(scr->status == SAM_STAT_BUSY ||
+			     scr->status == SAM_STAT_TASK_SET_FULL)) {
+			sop_depth_shrink(qinfo);
+			if (!sop_retry_later(h, qinfo, r))
+				return;
+			result = -EIO;
+			break;
+		}
 		result |= scr->status;
 		sense_data_len = le16_to_cpu(scr->sense_data_len);
 		response_data_len = le16_to_cpu(scr->response_data_len);
@@ -1451,8 +1865,10 @@ static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 
 			switch (disposition) {
 			case RETRY_ACTION:
-				retry_sop_request(h, qinfo, r);
-				return;
+				if (!sop_retry_later(h, qinfo, r))
+					return;
+				result = -EIO;
+				break;
 			case NO_ACTION:
 				break;
 			case FAIL_ACTION:
@@ -1475,8 +1891,9 @@ static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 			xfer_result = scr->data_out_xfer_result;
 			data_xferred = le32_to_cpu(scr->data_out_xferred);
 		}
-		/* Set the residual transfer size */
-		r->bio->bi_size = r->xfer_size - data_xferred;
+		/* Set the residual transfer size, a sync moves no data */
+		if (!r->flush)
+			r->bio->bi_size = r->xfer_size - data_xferred;
 
 		if (response_data_len) {
 			/* FIXME need to do something correct here... */
@@ -1500,29 +1917,49 @@ static void sop_complete_bio(struct sop_device *h, struct queue_info *qinfo,
 		break;
 	}
 
-	/* Is this (REQ_FLUSH with data) completing? */
-	if (unlikely(h->req_flush_bio != NULL && h->req_flush_bio == r->bio)) {
-		if (!h->sync_cache_done && result != -EIO) {
-			/* SYNC CACHE is now done.  Requeue for data xfer */
-			h->sync_cache_done = 1;
+	if (unlikely(r->flush)) {
+		sop_end_flush(h, qinfo, r, result);
+
+		/* SYNC CACHE is done, now send the data of a flush with data */
+		if (r->bio->bi_size && !result) {
+			r->bio->bi_rw &= ~REQ_FLUSH;
 			retry_sop_request(h, qinfo, r);
 			return;
-		} else {
-			/* This is the data xfer completing, or else -EIO.
-			 * Either way, we'rd done with (REQ_FLUSH with data)
-			 * bio, so complete it in the usual way.
-			 */
-			h->sync_cache_done = 0;
-			h->req_flush_bio = NULL;
 		}
 	}
 
+	/* Hand back reference tags as they were generated */
+	if (unlikely(bio_integrity(r->bio)) && !result &&
+	    bio_data_dir(r->bio) == READ)
+		sop_dif_remap(h, r->bio, 0);
+
 	atomic_dec(&h->bio_count);
 
 	bio_endio(r->bio, result);
 	free_request(h, &h->io_req[qinfo->numa_node], r->request_id);
 }
 
+/*
+ * Wake the task waiting for r.  A waiter that gave up has cleared
+ * r->waiting and left the request behind, it is freed here instead.
+ */
+static void sop_wake_waiter(struct sop_device *h, struct queue_info *q,
+			    struct sop_request *r)
+{
+	struct completion *waiting = xchg(&r->waiting, NULL);
+
+	if (likely(waiting)) {
+		complete(waiting);
+		return;
+	}
+	if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
+		dev_warn(&h->pdev->dev,
+			"Q[%d] rqid %d completed after its waiter gave up\n",
+			qinfo_to_qid(q), r->request_id);
+	free_request(h, sop_qinfo_pool(q), r->request_id);
+	sop_mgmt_wake(h, q);
+}
+
 static int sop_msix_handle_ioq(struct queue_info *q)
 {
 	u16 request_id;
@@ -1542,7 +1979,7 @@ static int sop_msix_handle_ioq(struct queue_info *q)
 			iu_type = pqi_peek_iu_type_from_device(q->oq);
 			request_id = pqi_peek_request_id_from_device(q->oq);
 			r = q->oq->cur_req =
-				&h->io_req[q->numa_node].request[request_id];
+				&sop_qinfo_pool(q)->request[request_id];
 			r->request_id = request_id;
 			r->response_accumulated = 0;
 			cmpl_pi = q->oq->unposted_index;
@@ -1555,15 +1992,18 @@ static int sop_msix_handle_ioq(struct queue_info *q)
 		if (sop_response_accumulated(r)) {
 			q->oq->cur_req = NULL;
 			wmb();
+			if (unlikely(r->tmo_stage != SOP_TMO_NONE))
+				sop_recovery_done(h, r);
 			if (likely(r->bio)) {
 				sop_update_log(r->log_index, cmpl_pi);
 				sop_complete_bio(h, q, r);
 			}
-			else if (likely(r->waiting))
-				complete(r->waiting);
-			else
-				dev_warn(&h->pdev->dev,
-					"r->bio and r->waiting both null\n");
+			else if (r->pt)
+				sop_complete_pt(h, q, r);
+			else {
+				sop_rem_timeout(q, r);
+				sop_wake_waiter(h, q, r);
+			}
 			atomic_dec(&h->cmd_pending);
 			atomic_dec(&q->cur_qdepth);
 			pqi_notify_device_queue_read(q->oq);
@@ -1606,6 +2046,7 @@ static int sop_msix_handle_adminq(struct queue_info *q)
 		if (sop_response_accumulated(r)) {
 			q->oq->cur_req = NULL;
 			wmb();
+			sop_rem_timeout(q, r);
 			complete(r->waiting);
 			pqi_notify_device_queue_read(q->oq);
 		}
@@ -1614,21 +2055,72 @@ static int sop_msix_handle_adminq(struct queue_info *q)
 	return IRQ_HANDLED;
 }
 
+static void sop_timeout_ios(struct queue_info *q, int action);
+
+/*
+ * Service the outbound queue on behalf of everybody who asked for it.
+ * The caller has already set the request bit(s) it wants handled.  If
+ * some other context owns the queue it will see the request bits before
+ * giving up ownership, so we just return.  Must be called with local
+ * interrupts disabled so that the owner never spins against its own
+ * interrupt handler.
+ */
+static int sop_oq_service(struct queue_info *q,
+			  int (*handler)(struct queue_info *q))
+{
+	int ret = IRQ_NONE;
+
+	do {
+		if (test_and_set_bit_lock(SOP_OQ_BITPOS_OWNED, &q->oq_flags))
+			return IRQ_HANDLED;
+
+		if (test_and_clear_bit(SOP_OQ_BITPOS_POLL, &q->oq_flags) &&
+		    handler(q) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+		if (test_and_clear_bit(SOP_OQ_BITPOS_TICK, &q->oq_flags))
+			sop_timeout_ios(q, atomic_read(&q->tick_action));
+
+		clear_bit_unlock(SOP_OQ_BITPOS_OWNED, &q->oq_flags);
+		smp_mb__after_clear_bit();
+	} while (q->oq_flags & (SOP_OQ_MASK_POLL | SOP_OQ_MASK_TICK));
+
+	return ret;
+}
+
+/*
+ * Take exclusive ownership of the outbound queue for a longer operation
+ * (reset requeue, failing all commands).  Local interrupts must be
+ * disabled.  Anything requested meanwhile is run by sop_oq_release().
+ */
+static void sop_oq_claim(struct queue_info *q)
+{
+	while (test_and_set_bit_lock(SOP_OQ_BITPOS_OWNED, &q->oq_flags))
+		cpu_relax();
+}
+
+static void sop_oq_release(struct queue_info *q,
+			   int (*handler)(struct queue_info *q))
+{
+	clear_bit_unlock(SOP_OQ_BITPOS_OWNED, &q->oq_flags);
+	smp_mb__after_clear_bit();
+	if (q->oq_flags & (SOP_OQ_MASK_POLL | SOP_OQ_MASK_TICK))
+		sop_oq_service(q, handler);
+}
+
 static irqreturn_t sop_ioq_msix_handler(int irq, void *devid)
 {
 	struct queue_info *q = devid;
 	int ret;
 
-	spin_lock(&q->oq->qlock);
-	ret = sop_msix_handle_ioq(q);
-	spin_unlock(&q->oq->qlock);
+	set_bit(SOP_OQ_BITPOS_POLL, &q->oq_flags);
+	ret = sop_oq_service(q, sop_msix_handle_ioq);
 
 	/*
 	 * If a command is completed above, try to fire
 	 * any pending commands in the wait Q
 	 */
-	if (ret == IRQ_HANDLED && !SOP_DEVICE_BUSY(q->h))
-		sop_resubmit_wait_list(q, sop_process_bio);
+	if (ret == IRQ_HANDLED)
+		sop_kick_wait_list(q);
 
 	return ret;
 }
@@ -1636,13 +2128,9 @@ static irqreturn_t sop_ioq_msix_handler(int irq, void *devid)
 static irqreturn_t sop_adminq_msix_handler(int irq, void *devid)
 {
 	struct queue_info *q = devid;
-	int ret;
-
-	spin_lock(&q->oq->qlock);
-	ret = sop_msix_handle_adminq(q);
-	spin_unlock(&q->oq->qlock);
 
-	return ret;
+	set_bit(SOP_OQ_BITPOS_POLL, &q->oq_flags);
+	return sop_oq_service(q, sop_msix_handle_adminq);
 }
 
 static void sop_irq_affinity_hints(struct sop_device *h)
@@ -1746,10 +2234,34 @@ static u16 alloc_admin_request(struct sop_device *h)
 	return rc;
 }
 
+/*
+ * The recovery worker holds the tag of the command it is aborting, so
+ * the ABORT TASK cannot hit a new command that got the tag in between.
+ */
+static int sop_tag_held(struct sop_device *h, struct sop_request *r)
+{
+	unsigned long flags;
+	int held;
+
+	spin_lock_irqsave(&h->recovery_lock, flags);
+	held = r->tag_hold;
+	if (held)
+		r->tag_freed = 1;
+	spin_unlock_irqrestore(&h->recovery_lock, flags);
+	return held;
+}
+
 static void free_request(struct sop_device *h, struct sop_request_pool *p,
 				u16 request_id)
 {
+	struct sop_request *r;
+
 	BUG_ON(request_id >= p->num_requests);
+	r = &p->request[request_id];
+	r->pt = NULL;
+	r->flush = 0;
+	if (unlikely(r->tag_hold) && sop_tag_held(h, r))
+		return;
 	clear_bit(request_id, p->request_bits);
 }
 
@@ -1813,13 +2325,15 @@ static void send_admin_command(struct sop_device *h, u16 request_id)
 
 	request = &h->admin_req.request[request_id];
 	memset(request, 0, sizeof(*request));
+	INIT_LIST_HEAD(&request->tmo_entry);
+	INIT_LIST_HEAD(&request->recovery_entry);
 	request->waiting = &wait;
 	request->response_accumulated = 0;
-	request->tmo_slot = sop_add_timeout(qinfo, DEF_IO_TIMEOUT);
+	sop_add_timeout(qinfo, request, DEF_IO_TIMEOUT * MSEC_PER_SEC);
 	request->retry_count = 0;
 	pqi_notify_device_queue_written(qinfo->iq);
 	wait_for_completion(&wait);
-	sop_rem_timeout(qinfo, request->tmo_slot);
+	sop_rem_timeout(qinfo, request);
 }
 
 static int fill_get_pqi_device_capabilities(struct sop_device *h,
@@ -1982,7 +2496,7 @@ static void sop_examine_report_general_results(struct sop_device *h,
 	if ((rg->max_data_buffers) && (rg->max_data_buffers < MAX_SGLS))
 		h->max_sgls = rg->max_data_buffers;
 }
-static inline int find_sop_queue(struct sop_device *h, int cpu);
+static inline int sop_mgmt_qpindex(struct sop_device *h);
 static void send_sop_command(struct sop_device *h, struct queue_info *qinfo,
 				struct sop_request *sopr);
 
@@ -1993,10 +2507,11 @@ static int sop_report_general(struct sop_device *h)
 	struct management_response_iu *resp;
 	int queue_pair_index;
 	struct queue_info *qinfo;
+	struct sop_request_pool *pool;
 	struct sop_request *ser;
 	u16 request_id = (u16) -EBUSY;
 	u64 busaddr;
-	int cpu, rc;
+	int rc;
 
 	/* Initialize the field, irrespective of outcome of this call */
 	h->max_sgls = MAX_SGLS;
@@ -2006,11 +2521,12 @@ static int sop_report_general(struct sop_device *h)
 	if (!buffer)
 		return -ENOMEM;
 
-	cpu = get_cpu();
-	queue_pair_index = find_sop_queue(h, cpu);
+	queue_pair_index = sop_mgmt_qpindex(h);
 	qinfo = &h->qinfo[queue_pair_index];
+	pool = sop_qinfo_pool(qinfo);
+	get_cpu();
 	spin_lock_irq(&qinfo->iq->qlock);
-	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
+	request_id = alloc_request(h, pool);
 	if (request_id == (u16) -EBUSY) {
 		if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
 			dev_warn(&h->pdev->dev,
@@ -2027,7 +2543,7 @@ static int sop_report_general(struct sop_device *h)
 			queue_pair_index, PTR_ERR(r));
 		goto rep_gen_alloc_elm_fail;
 	}
-	ser = &h->io_req[qinfo->numa_node].request[request_id];
+	ser = &pool->request[request_id];
 	/* Init fields of sop request context */
 	ser->start_time = jiffies;
 	ser->qid = queue_pair_index;
@@ -2039,10 +2555,10 @@ static int sop_report_general(struct sop_device *h)
 		rc = -ENOMEM;
 		goto rep_gen_prep_fail;
 	}
-	ser->tmo_slot = sop_add_timeout(qinfo, DEF_IO_TIMEOUT);
+	sop_add_timeout(qinfo, ser, DEF_IO_TIMEOUT * MSEC_PER_SEC);
 	ser->retry_count = 0;
 	send_sop_command(h, qinfo, ser);
-	sop_rem_timeout(qinfo, ser->tmo_slot);
+	sop_rem_timeout(qinfo, ser);
 	busaddr = le64_to_cpu(r->sg.address);
 	pci_unmap_single(h->pdev, busaddr, sizeof(*buffer),
 						PCI_DMA_FROMDEVICE);
@@ -2052,7 +2568,7 @@ static int sop_report_general(struct sop_device *h)
 		rc = 0;
 		goto rep_gen_issue_fail;
 	}
-	free_request(h, &h->io_req[qinfo->numa_node], request_id);
+	free_request(h, pool, request_id);
 	sop_examine_report_general_results(h, buffer);
 	kfree(buffer);
 	return 0;
@@ -2060,7 +2576,7 @@ static int sop_report_general(struct sop_device *h)
 rep_gen_prep_fail:
 	pqi_unalloc_elements(qinfo->iq, 1);
 rep_gen_alloc_elm_fail:
-	free_request(h, &h->io_req[qinfo->numa_node], request_id);
+	free_request(h, pool, request_id);
 rep_gen_alloc_req_fail:
 	spin_unlock_irq(&qinfo->iq->qlock);
 	put_cpu();
@@ -2159,6 +2675,7 @@ static void sop_free_io_queues(struct sop_device *h)
 
 	for (i = 0; i < h->num_io_req_pool; i++)
 		pqi_pool_buffer_free(h, &h->io_req[i]);
+	pqi_pool_buffer_free(h, &h->mgmt_req);
 
 	for (i = 1; i < h->nr_queue_pairs; i++) {
 		struct queue_info *qinfo = &h->qinfo[i];
@@ -2202,7 +2719,16 @@ static int sop_setup_io_queue_pairs(struct sop_device *h)
 	/* Next allocate the io request buffer pool */
 	h->num_io_req_pool = num_nodes;
 	for (i = 0; i < num_nodes; i++) {
-		err = pqi_ioq_pool_alloc(h, h->io_req + i, i);
+		err = pqi_ioq_pool_alloc(h, h->io_req + i, MAX_IO_CMDS, i);
+		if (err)
+			goto bail_out;
+	}
+
+	/* Keep the last IO queue pair back for SG_IO and internal commands */
+	h->mgmt_qpindex = (h->nr_queue_pairs > 2) ? h->nr_queue_pairs - 1 : 0;
+	if (h->mgmt_qpindex) {
+		err = pqi_ioq_pool_alloc(h, &h->mgmt_req, MAX_MGMT_CMDS,
+				h->qinfo[h->mgmt_qpindex].numa_node);
 		if (err)
 			goto bail_out;
 	}
@@ -2223,6 +2749,13 @@ allocate_queue_mem:
 			break;
 
 		bio_list_init(&h->qinfo[i].wait_list);
+		bio_list_init(&h->qinfo[i].retry_list);
+		bio_list_init(&h->qinfo[i].flush_wait);
+		h->qinfo[i].flush_busy = 0;
+		h->qinfo[i].wait_run_head = 0;
+		h->qinfo[i].wait_run_cnt = 0;
+		h->qinfo[i].depth_limit = h->elements_per_io_queue;
+		h->qinfo[i].depth_credit = 0;
 	}
 	if (err) {
 		if (err != -ENOMEM)
@@ -2438,10 +2971,37 @@ static int __devinit sop_probe(struct pci_dev *pdev,
 	}
 
 	/* Initialize device structure */
-	for (i = 0; i < MAX_TOTAL_QUEUE_PAIRS; i++)
+	for (i = 0; i < MAX_TOTAL_QUEUE_PAIRS; i++) {
 		h->qinfo[i].h = h;
+		sop_init_timeout(&h->qinfo[i].tmo);
+		hrtimer_init(&h->qinfo[i].retry_timer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_REL);
+		h->qinfo[i].retry_timer.function = sop_retry_timer_fn;
+		hrtimer_init(&h->qinfo[i].drain_timer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_REL);
+		h->qinfo[i].drain_timer.function = sop_drain_timer_fn;
+	}
 	sprintf(h->devname, SOP"%d", h->instance);
+	h->wq = sop_alloc_workqueue(h->devname,
+				WQ_FREEZABLE | WQ_MEM_RECLAIM, 0);
+	if (!h->wq) {
+		rc = -ENOMEM;
+		goto bail_release_instance;
+	}
 	INIT_DELAYED_WORK(&h->dwork, NULL);
+	INIT_DELAYED_WORK(&h->timer_work, sop_timer_wq);
+	INIT_LIST_HEAD(&h->recovery_list);
+	spin_lock_init(&h->recovery_lock);
+	init_waitqueue_head(&h->mgmt_wait);
+	init_rwsem(&h->pt_rwsem);
+	mutex_init(&h->pt_mutex);
+	INIT_LIST_HEAD(&h->pt_files);
+	kref_init(&h->ref);
+	INIT_WORK(&h->recovery_work, sop_recovery_wq);
+	INIT_WORK(&h->revalidate_work, sop_revalidate_wq);
+	INIT_DELAYED_WORK(&h->scrub_work, sop_scrub_wq);
+	spin_lock_init(&h->scrub_lock);
+	spin_lock_init(&h->wgroup_lock);
 	h->flags = 0;
 
 	h->pdev = pdev;
@@ -2454,6 +3014,9 @@ static int __devinit sop_probe(struct pci_dev *pdev,
 	list_add(&h->node, &dev_list);
 	spin_unlock(&dev_list_lock);
 
+	/* Timeouts of the admin commands below are driven from here */
+	sop_arm_timer(h);
+
 	rc = pci_enable_device(pdev);
 	if (rc) {
 		dev_warn(&h->pdev->dev, "Unable to enable PCI device\n");
@@ -2462,6 +3025,8 @@ static int __devinit sop_probe(struct pci_dev *pdev,
 
 	/* Enable bus mastering (pci_disable_device may disable this) */
 	pci_set_master(h->pdev);
+	pci_enable_pcie_error_reporting(pdev);
+	pci_save_state(pdev);
 
 	rc = pci_request_regions(h->pdev, SOP);
 	if (rc) {
@@ -2546,6 +3111,12 @@ static int __devinit sop_probe(struct pci_dev *pdev,
 		dev_warn(&h->pdev->dev, "Bailing out in probe - Cannot add disk\n");
 		goto bail_io_irq;
 	}
+
+	/* The block device works without it, so this is not fatal */
+	if (sop_pt_register(h)) {
+		dev_warn(&h->pdev->dev, "Cannot register passthrough device\n");
+		h->ptdev.name = NULL;
+	}
 	dev_warn(&h->pdev->dev, "Successfully loaded device '%s'\n",
 			h->devname);
 
@@ -2575,9 +3146,14 @@ bail_set_drvdata:
 	spin_lock(&dev_list_lock);
 	list_del(&h->node);
 	spin_unlock(&dev_list_lock);
+	cancel_delayed_work_sync(&h->timer_work);
 	cancel_delayed_work_sync(&h->dwork);
+	cancel_work_sync(&h->recovery_work);
+	cancel_work_sync(&h->revalidate_work);
+	destroy_workqueue(h->wq);
 
 	pci_set_drvdata(pdev, NULL);
+bail_release_instance:
 	sop_release_instance(h);
 bail_alloc_drvdata:
 	kfree(h);
@@ -2650,6 +3226,7 @@ static int sop_release_hw(struct sop_device *h)
 {
 	sop_stop_unit(h);
 	sop_fail_all_outstanding_io(h);
+	cancel_work_sync(&h->recovery_work);
 	sop_free_io_irqs(h);
 	sop_delete_io_queues(h);
 	sop_free_admin_irq_and_disable_msix(h);
@@ -2678,7 +3255,7 @@ static int sop_suspend(struct pci_dev *pdev, pm_message_t state)
 	sop_power_action(h, action);
 
 	/*
-	 * sop_thread is already frozen by kernel
+	 * The device workqueue is already frozen by kernel
 	 * before this suspend function is called
 	 */
 
@@ -2772,24 +3349,33 @@ static void __devexit sop_remove(struct pci_dev *pdev)
 
 	dev_warn(&pdev->dev, "Remove called.\n");
 	h = pci_get_drvdata(pdev);
+	if (h->ptdev.name)
+		misc_deregister(&h->ptdev);
+	sop_pt_kill_files(h);
 	sop_remove_disk(h);
 	sop_release_hw(h);
+	sop_pt_drain_files(h);
 	sop_free_io_queues(h);
 	sop_free_admin_queues(h);
 	if (h->pqireg)
 		iounmap(h->pqireg);
 	pci_release_regions(pdev);
+	pci_disable_pcie_error_reporting(pdev);
 	pci_disable_device(pdev);
 
 	spin_lock(&dev_list_lock);
 	list_del(&h->node);
 	spin_unlock(&dev_list_lock);
+	cancel_delayed_work_sync(&h->timer_work);
 	cancel_delayed_work_sync(&h->dwork);
+	cancel_work_sync(&h->recovery_work);
+	cancel_work_sync(&h->revalidate_work);
+	destroy_workqueue(h->wq);
 
 	pci_set_drvdata(pdev, NULL);
 	sop_release_instance(h);
 	dev_warn(&pdev->dev, "Device Removed\n");
-	kfree(h);
+	kref_put(&h->ref, sop_free_device);
 }
 
 static void sop_shutdown(struct pci_dev *pdev)
@@ -2819,13 +3405,6 @@ static int __init sop_init(void)
 {
 	int	result;
 
-	sop_thread = kthread_run(sop_thread_proc, NULL, "sop");
-	if (IS_ERR(sop_thread)) {
-		pr_warn("%s Init: Thread creation failed with %p!\n",
-				DRIVER_NAME, sop_thread);
-		return PTR_ERR(sop_thread);
-	}
-
 	result = sop_init_log();
 	if (result)
 		goto allocate_fail;
@@ -2849,6 +3428,11 @@ static int __init sop_init(void)
 	if (result)
 		goto create_fail_dbg_lvl;
 
+	result = driver_create_file(&sop_pci_driver.driver,
+					&driver_attr_zero_detect);
+	if (result)
+		goto create_fail_zero_detect;
+
 	pr_info("%s Initialized!\n", DRIVER_NAME);
 	/*
 	pr_info("Allocated Virtual Mem: %d, Coherent Mem: %d, Local SGL Mem: %d\n",
@@ -2857,6 +3441,8 @@ static int __init sop_init(void)
 
 	return 0;
 
+create_fail_zero_detect:
+	driver_remove_file(&sop_pci_driver.driver, &driver_attr_dbg_lvl);
 create_fail_dbg_lvl:
 	driver_remove_file(&sop_pci_driver.driver, &driver_attr_debug);
 create_fail:
@@ -2872,7 +3458,6 @@ create_fail:
 		result);
 	SOP_FREE_LOG();
 allocate_fail:
-	kthread_stop(sop_thread);
 	return result;
 
 }
@@ -2881,10 +3466,10 @@ static void __exit sop_exit(void)
 {
 	driver_remove_file(&sop_pci_driver.driver, &driver_attr_debug);
 	driver_remove_file(&sop_pci_driver.driver, &driver_attr_dbg_lvl);
+	driver_remove_file(&sop_pci_driver.driver, &driver_attr_zero_detect);
 	SOP_FREE_LOG();
 	pci_unregister_driver(&sop_pci_driver);
 	unregister_blkdev(sop_major, SOP);
-	kthread_stop(sop_thread);
 	pr_info("%s: Driver unloaded\n", DRIVER_NAME);
 }
 
@@ -2896,22 +3481,175 @@ static inline struct sop_device *bdev_to_hba(struct block_device *bdev)
 
 static inline int find_sop_queue(struct sop_device *h, int cpu)
 {
-	return 1 + (cpu % (h->nr_queue_pairs - 1));
+	int nr_data = h->nr_queue_pairs - 1;
+
+	/* The management queue pair never carries bios */
+	if (h->mgmt_qpindex)
+		nr_data--;
+	return 1 + (cpu % nr_data);
 }
 
-#define	SCSI_READ_BASIC			0x08
-#define	SCSI_WRITE_BASIC		0x0A
+/* Queue pair for SG_IO and internal commands, shared if none is spare */
+static inline int sop_mgmt_qpindex(struct sop_device *h)
+{
+	return h->mgmt_qpindex ? h->mgmt_qpindex : 1;
+}
 
-#define	SCSI_CMD_RW_10_PRE		0x20
-#define	SCSI_CMD_RW_12_PRE		0xA0
-#define	SCSI_CMD_RW_16_PRE		0x80
+static inline int sop_pool_has_room(struct sop_request_pool *p)
+{
+	return find_first_zero_bit(p->request_bits, p->num_requests) <
+		p->num_requests - 1;
+}
+
+/*
+ * The last SOP_MGMT_LOCK_RESERVE requests of a dedicated management
+ * queue are kept for lock operations, so that SG_IO traffic cannot
+ * hold a COMPARE AND WRITE up.  A shared queue has no such reserve.
+ */
+static inline int sop_mgmt_reserved(struct sop_device *h,
+				    struct sop_request_pool *p)
+{
+	return p == &h->mgmt_req &&
+		p->num_requests - 1 - bitmap_weight(p->request_bits,
+			p->num_requests - 1) <= SOP_MGMT_LOCK_RESERVE;
+}
+
+/* A request ID and an IQ element, either may be what is missing */
+static inline int sop_mgmt_has_room(struct sop_device *h,
+				    struct queue_info *qinfo,
+				    struct sop_request_pool *p, int lock_op)
+{
+	if (!lock_op && sop_mgmt_reserved(h, p))
+		return 0;
+	return sop_pool_has_room(p) &&
+		!pqi_to_device_queue_is_full(qinfo->iq, 1);
+}
+
+/* A request of the management queue was freed outside send_sync_cdb */
+static void sop_mgmt_wake(struct sop_device *h, struct queue_info *q)
+{
+	if (qinfo_to_qid(q) == sop_mgmt_qpindex(h))
+		wake_up(&h->mgmt_wait);
+}
+
+#define	SCSI_READ_BASIC			0x08
+#define	SCSI_WRITE_BASIC		0x0A
+
+#define	SCSI_CMD_RW_10_PRE		0x20
+#define	SCSI_CMD_RW_12_PRE		0xA0
+#define	SCSI_CMD_RW_16_PRE		0x80
 
 #define	SOP_GET_BYTE(x, n)		(((x) >> ((n) << 3)) & 0xFF)
 
+/* VPD 0xb2 byte 5 and the WRITE SAME(16) UNMAP bit */
+#define	SOP_LBP_WS16			0x40
+#define	SOP_LBP_LBPRZ			0x04
+#define	SOP_WS_UNMAP			0x08
+
+/* WRITE SAME limit when the block limits page gives none */
+#define	SOP_WS_DEFAULT_BLOCKS		0x7fffffULL
+
+/* Most blocks one UNMAP block descriptor can carry */
+#define	SOP_UNMAP_DESC_BLOCKS		0xffffffffULL
+
+/* Each request's slot of the pool SGL area */
+#define	SOP_SGL_SLOT_SIZE(h)	\
+	((h)->max_sgls * sizeof(struct pqi_sgl_descriptor))
+
+/* Descriptors that fit in that slot */
+#define	SOP_UNMAP_MAX_DESC(h)	\
+	((SOP_SGL_SLOT_SIZE(h) - sizeof(struct sop_unmap_param_list)) / \
+	sizeof(struct sop_unmap_blk_desc))
+
+/* Smallest opt_xfer_gran worth splitting bios on */
+#define	SOP_SPLIT_MIN_BYTES		(64 * 1024)
+
+/* Largest write scanned for zero_detect */
+#define	SOP_ZERO_SCAN_MAX		(1024 * 1024)
+
 #define	SOP_FUA				0x08
 #define	SOP_DPO				0x10
+#define	SOP_EXT_INQ_GROUP_SUP		0x10
+#define	SOP_RWPROTECT			0x20	/* PI with the data, checked */
 
 /* Prepares the CDB from the bio passed */
+/*
+ * Four words per pass with a single test.  This runs in the submit
+ * path, which is also entered from the ISR and timer resubmits where
+ * the FPU can't be used, so SSE/AVX is not an option.
+ */
+static int sop_buf_is_zero(const void *buf, unsigned int len)
+{
+	const unsigned long *p = buf;
+
+	if (!IS_ALIGNED((unsigned long) buf | len, sizeof(*p)))
+		return !memchr_inv(buf, 0, len);
+
+	for (; len >= 4 * sizeof(*p); len -= 4 * sizeof(*p), p += 4)
+		if (p[0] | p[1] | p[2] | p[3])
+			return 0;
+	for (; len; len -= sizeof(*p), p++)
+		if (*p)
+			return 0;
+	return 1;
+}
+
+static int sop_bio_is_zero(struct bio *bio)
+{
+	struct bio_vec *bv;
+	void *buf;
+	int i, zero = 1;
+
+	bio_for_each_segment(bv, bio, i) {
+		buf = kmap_atomic(bv->bv_page);
+		zero = sop_buf_is_zero(buf + bv->bv_offset, bv->bv_len);
+		kunmap_atomic(buf);
+		if (!zero)
+			break;
+	}
+	return zero;
+}
+
+/*
+ * Could this write go out as WRITE SAME of one zeroed block?  Only the
+ * scan of a bio that really is all zero runs to the end, and that is
+ * paid back by not moving the data.
+ */
+static int sop_zero_write(struct sop_device *h, struct bio *bio)
+{
+	if (likely(!sop_zero_detect))
+		return 0;
+	if (bio_data_dir(bio) != WRITE || bio_integrity(bio) ||
+	    (bio->bi_rw & (REQ_FUA | REQ_WRITE_SAME | REQ_DISCARD)))
+		return 0;
+	if (!bio->bi_size || bio->bi_size > SOP_ZERO_SCAN_MAX ||
+	    bio->bi_size % h->block_size ||
+	    bio_sectors(bio) > h->max_ws_sectors ||
+	    h->block_size > SOP_SGL_SLOT_SIZE(h))
+		return 0;
+	return sop_bio_is_zero(bio);
+}
+
+static void sop_prepare_write_same_cdb(struct sop_device *h, u8 *cdb,
+				       struct bio *bio, int zero)
+{
+	u32 num_sec = bio_sectors(bio);
+	u64 lba = bio->bi_sector;
+	int i;
+
+	memset(cdb, 0, 16);
+	cdb[0] = WRITE_SAME_16;
+
+	/* Zeroes may be deallocated if unmapped blocks read back as zero */
+	if (zero && (h->lbp_flags & SOP_LBP_WS16) &&
+	    (h->lbp_flags & SOP_LBP_LBPRZ))
+		cdb[1] = SOP_WS_UNMAP;
+	for (i = 0; i < 8; i++)
+		cdb[2 + i] = SOP_GET_BYTE(lba, 7 - i);
+	for (i = 0; i < 4; i++)
+		cdb[10 + i] = SOP_GET_BYTE(num_sec, 3 - i);
+}
+
 static int sop_prepare_cdb(u8 *cdb, struct bio *bio)
 {
 	u32     num_sec;
@@ -2979,20 +3717,48 @@ static int sop_prepare_cdb(u8 *cdb, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Tag a write with the GROUP NUMBER of the range it starts in, so data
+ * with a different lifetime can be kept apart on the media.  The table
+ * is tiny and empty unless someone filled in write_groups.
+ */
+static void sop_set_write_group(struct sop_device *h, u8 *cdb,
+				struct bio *bio)
+{
+	struct sop_write_group *wg;
+	u64 lba = bio->bi_sector;
+	u32 i, nr = ACCESS_ONCE(h->nr_wgroups);
+
+	smp_rmb();
+	for (i = 0; i < nr; i++) {
+		wg = &h->wgroup[i];
+		if (lba - wg->lba >= wg->nblocks)
+			continue;
+		switch (cdb[0] & 0xe0) {
+		case SCSI_CMD_RW_10_PRE:
+			cdb[6] = wg->group & 0x1f;
+			break;
+		case SCSI_CMD_RW_12_PRE:
+			cdb[10] = wg->group & 0x1f;
+			break;
+		case SCSI_CMD_RW_16_PRE:	/* WRITE SAME(16) too */
+			cdb[14] = wg->group & 0x3f;
+			break;
+		}
+		return;
+	}
+}
+
 /* Returns the numbers of sg prepared in sgl */
-static int sop_get_sync_cdb_scatterlist(struct sop_sync_cdb_req *sio,
-					struct scatterlist  *sgl,
-					int max_sgl)
+/* Pin the user pages of sio->iov into sgl, page_map holds max_sgl */
+static int sop_map_user_iov(struct sop_sync_cdb_req *sio,
+				struct scatterlist *sgl, int max_sgl,
+				struct page **page_map)
 {
 	int i, j, nsegs, count, err;
 	int iov_count, write;
 	struct iovec *iov_array = sio->iov;
 	struct scatterlist *cur_sg = NULL;
-	struct page **page_map;
-
-	page_map = kcalloc(max_sgl, sizeof(*page_map), GFP_KERNEL);
-	if (!page_map)
-		return -ENOMEM;
 
 	nsegs = 0;
 	iov_count = sio->iov_count;
@@ -3065,7 +3831,6 @@ static int sop_get_sync_cdb_scatterlist(struct sop_sync_cdb_req *sio,
 		}
 	}
 	sg_mark_end(&sgl[nsegs-1]);
-	kfree(page_map);
 
 	/* Store the current index of iovec to be processed next */
 	sio->iovec_idx = i;
@@ -3082,13 +3847,28 @@ err_iovec:
 	for (i = 0; i < nsegs; i++)
 		put_page(sg_page(&sgl[i]));
 
-	/* Free the memory allocated */
-	kfree(page_map);
-
 	/* Start all over next time,  sio->iovec_idx is not changed*/
 	return err;
 }
 
+static int sop_get_sync_cdb_scatterlist(struct sop_sync_cdb_req *sio,
+					struct scatterlist  *sgl,
+					int max_sgl)
+{
+	struct page **page_map;
+	int nsegs;
+
+	page_map = kcalloc(max_sgl, sizeof(*page_map), GFP_KERNEL);
+	if (!page_map)
+		return -ENOMEM;
+
+	nsegs = sop_map_user_iov(sio, sgl, max_sgl, page_map);
+
+	/* Free the memory allocated */
+	kfree(page_map);
+	return nsegs;
+}
+
 /*
  * Prepares the scatterlist for the given bio.
  * - taken from blk_rq_map_sg in block./blk-merge.c
@@ -3141,6 +3921,249 @@ static int sop_prepare_scatterlist(struct bio *bio, struct sop_request *ser,
 	return num_sg;
 }
 
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+/*
+ * Block layer side of T10 PI, as in drivers/scsi/sd_dif.c.  Type 3
+ * has no reference tag, type 2 needs 32 byte CDBs we cannot send.
+ */
+static void sop_dif_generate(struct blk_integrity_exchg *bix, int type1)
+{
+	void *buf = bix->data_buf;
+	struct sop_dif_tuple *sdt = bix->prot_buf;
+	sector_t sector = bix->sector;
+	unsigned int i;
+
+	for (i = 0; i < bix->data_size; i += bix->sector_size, sdt++) {
+		sdt->guard_tag = cpu_to_be16(crc_t10dif(buf, bix->sector_size));
+		sdt->ref_tag = type1 ? cpu_to_be32(sector & 0xffffffff) : 0;
+		sdt->app_tag = 0;
+		buf += bix->sector_size;
+		sector++;
+	}
+}
+
+static int sop_dif_verify(struct blk_integrity_exchg *bix, int type1)
+{
+	void *buf = bix->data_buf;
+	struct sop_dif_tuple *sdt = bix->prot_buf;
+	sector_t sector = bix->sector;
+	unsigned int i;
+	u16 csum;
+
+	for (i = 0; i < bix->data_size; i += bix->sector_size, sdt++) {
+		/* An escaped block is not checked */
+		if (sdt->app_tag == 0xffff &&
+		    (type1 || sdt->ref_tag == 0xffffffff))
+			goto next;
+
+		if (type1 && be32_to_cpu(sdt->ref_tag) !=
+				(sector & 0xffffffff)) {
+			pr_err("%s: ref tag error on sector %lu (rcvd %u)\n",
+				bix->disk_name, (unsigned long) sector,
+				be32_to_cpu(sdt->ref_tag));
+			return -EIO;
+		}
+
+		csum = crc_t10dif(buf, bix->sector_size);
+		if (sdt->guard_tag != cpu_to_be16(csum)) {
+			pr_err("%s: guard tag error on sector %lu (rcvd %04x, data %04x)\n",
+				bix->disk_name, (unsigned long) sector,
+				be16_to_cpu(sdt->guard_tag), csum);
+			return -EIO;
+		}
+next:
+		buf += bix->sector_size;
+		sector++;
+	}
+	return 0;
+}
+
+static void sop_dif_type1_generate(struct blk_integrity_exchg *bix)
+{
+	sop_dif_generate(bix, 1);
+}
+
+static int sop_dif_type1_verify(struct blk_integrity_exchg *bix)
+{
+	return sop_dif_verify(bix, 1);
+}
+
+static void sop_dif_type3_generate(struct blk_integrity_exchg *bix)
+{
+	sop_dif_generate(bix, 0);
+}
+
+static int sop_dif_type3_verify(struct blk_integrity_exchg *bix)
+{
+	return sop_dif_verify(bix, 0);
+}
+
+static struct blk_integrity sop_dif_type1 = {
+	.name			= "T10-DIF-TYPE1-CRC",
+	.generate_fn		= sop_dif_type1_generate,
+	.verify_fn		= sop_dif_type1_verify,
+	.tuple_size		= sizeof(struct sop_dif_tuple),
+	.tag_size		= 0,
+};
+
+static struct blk_integrity sop_dif_type3 = {
+	.name			= "T10-DIF-TYPE3-CRC",
+	.generate_fn		= sop_dif_type3_generate,
+	.verify_fn		= sop_dif_type3_verify,
+	.tuple_size		= sizeof(struct sop_dif_tuple),
+	.tag_size		= 0,
+};
+
+/*
+ * Type 1 reference tags have to be the LBA the device sees.  Someone
+ * stacked above may have generated them for another sector, move them
+ * over on the way out and back on the way in.
+ */
+static void sop_dif_remap(struct sop_device *h, struct bio *bio, int to_dev)
+{
+	struct bio_integrity_payload *bip = bio->bi_integrity;
+	sector_t from = to_dev ? bip->bip_sector : bio->bi_sector;
+	sector_t to = to_dev ? bio->bi_sector : bip->bip_sector;
+	struct sop_dif_tuple *sdt;
+	struct bio_vec *iv;
+	unsigned int j;
+	void *p;
+	int i;
+
+	if (h->prot_type != 1 || from == to)
+		return;
+
+	bip_for_each_vec(iv, bip, i) {
+		p = kmap_atomic(iv->bv_page);
+		sdt = p + iv->bv_offset;
+		for (j = 0; j < iv->bv_len; j += sizeof(*sdt), sdt++) {
+			if (be32_to_cpu(sdt->ref_tag) == (from & 0xffffffff))
+				sdt->ref_tag = cpu_to_be32(to & 0xffffffff);
+			from++;
+			to++;
+		}
+		kunmap_atomic(p);
+	}
+}
+
+/*
+ * The device wants each block's tuple right behind its data, so weave
+ * the integrity vector into the data scatterlist.  SOP_CMD_IU would not
+ * help: like the limited IU it carries one data buffer and no separate
+ * PI descriptors.  Returns the number of entries or -EINVAL if that
+ * does not fit in max_sgls.
+ */
+static int sop_prepare_pi_scatterlist(struct sop_device *h, struct bio *bio,
+				      struct scatterlist *sgl)
+{
+	struct bio_integrity_payload *bip = bio->bi_integrity;
+	struct scatterlist *cur_sg = NULL;
+	struct bio_vec *bv, *iv;
+	unsigned int off, len, left = h->block_size;
+	int i, num_sg = 0, pi_idx = bip->bip_idx, pi_off = 0;
+
+	sop_dif_remap(h, bio, 1);
+	sg_init_table(sgl, h->max_sgls);
+	bio_for_each_segment(bv, bio, i) {
+		for (off = 0; off < bv->bv_len; off += len) {
+			len = min(bv->bv_len - off, left);
+			if (num_sg + 2 > h->max_sgls)
+				return -EINVAL;
+			cur_sg = &sgl[num_sg++];
+			sg_set_page(cur_sg, bv->bv_page, len,
+					bv->bv_offset + off);
+			left -= len;
+			if (left)
+				continue;
+
+			/* A whole block, its tuple goes next */
+			iv = &bip->bip_vec[pi_idx];
+			if (pi_idx >= bip->bip_vcnt ||
+			    iv->bv_len - pi_off < sizeof(struct sop_dif_tuple))
+				return -EINVAL;
+			cur_sg = &sgl[num_sg++];
+			sg_set_page(cur_sg, iv->bv_page,
+					sizeof(struct sop_dif_tuple),
+					iv->bv_offset + pi_off);
+			pi_off += sizeof(struct sop_dif_tuple);
+			if (pi_off == iv->bv_len) {
+				pi_idx++;
+				pi_off = 0;
+			}
+			left = h->block_size;
+		}
+	}
+	if (left != h->block_size || !cur_sg)
+		return -EINVAL;
+	sg_mark_end(cur_sg);
+	return num_sg;
+}
+
+/*
+ * With integrity on, PI from above goes to the device and back.  The
+ * block layer is not asked to generate or verify anything itself: a
+ * bio without PI is written with WRPROTECT 0 and the device makes up
+ * its own, which costs the host nothing.
+ *
+ * Switching it changes the queue limits, so sysfs only does that while
+ * nobody has the disk open.  Before add_disk() just the limits are set,
+ * the profile lives in sysfs under the disk and is registered right
+ * after.
+ */
+static int sop_set_integrity(struct sop_device *h, int on)
+{
+	struct blk_integrity *bi = NULL;
+	u32 max_blocks;
+
+	if (on && h->prot_type == 1)
+		bi = &sop_dif_type1;
+	else if (on && h->prot_type == 3)
+		bi = &sop_dif_type3;
+
+	blk_queue_max_hw_sectors(h->rq, h->max_hw_sectors);
+	if (!bi) {
+		if (h->pi_enabled)
+			blk_integrity_unregister(h->disk);
+		h->pi_enabled = 0;
+		return on ? -EOPNOTSUPP : 0;
+	}
+
+	if (h->disk->flags & GENHD_FL_UP) {
+		if (blk_integrity_register(h->disk, bi)) {
+			h->pi_enabled = 0;
+			return -ENOMEM;
+		}
+		h->disk->integrity->flags &= ~(INTEGRITY_FLAG_READ |
+						INTEGRITY_FLAG_WRITE);
+	}
+
+	/* Worst case a block takes two entries and its tuple one more */
+	max_blocks = h->max_sgls / 3;
+	blk_queue_max_hw_sectors(h->rq, min_t(u32, h->max_hw_sectors,
+				max_blocks * (h->block_size >> 9)));
+	blk_queue_max_integrity_segments(h->rq, max_blocks);
+	h->pi_enabled = 1;
+	return 0;
+}
+#else
+static inline int sop_prepare_pi_scatterlist(struct sop_device *h,
+				struct bio *bio, struct scatterlist *sgl)
+{
+	return -EINVAL;
+}
+
+static inline void sop_dif_remap(struct sop_device *h, struct bio *bio,
+				 int to_dev)
+{
+}
+
+static inline int sop_set_integrity(struct sop_device *h, int on)
+{
+	h->pi_enabled = 0;
+	return on ? -EOPNOTSUPP : 0;
+}
+#endif
+
 static void fill_sg_data_element(struct pqi_sgl_descriptor *sgld,
 				struct scatterlist *sg, u32 *xfer_size)
 {
@@ -3215,9 +4238,9 @@ static int sop_scatter_gather(struct sop_device *h,
 	for (i = 0; i < num_sg; i++) {
 		if (i == 1) {
 			fill_sg_chain_element(datasg,
-				h->io_req[q->numa_node].sg_bus_addr,
+				sop_qinfo_pool(q)->sg_bus_addr,
 				sg_block_number, num_sg-1);
-			datasg = &h->io_req[q->numa_node].sg[sg_block_number];
+			datasg = &sop_qinfo_pool(q)->sg[sg_block_number];
 		}
 		fill_sg_data_element(datasg, &sgl[i], xfer_size);
 		datasg++;
@@ -3226,7 +4249,7 @@ static int sop_scatter_gather(struct sop_device *h,
 }
 
 static int sop_send_sync_cache(struct sop_device *h, struct bio *bio,
-				struct queue_info *qinfo, struct bio *req_flush_bio)
+				struct queue_info *qinfo)
 {
 	struct sop_limited_cmd_iu *r;
 	struct sop_request *ser;
@@ -3234,6 +4257,10 @@ static int sop_send_sync_cache(struct sop_device *h, struct bio *bio,
 	u16 request_id;
 	int num_sg;
 
+	/* Stay within the window the device can currently take */
+	if (atomic_read(&qinfo->cur_qdepth) >= qinfo->depth_limit)
+		return -EBUSY;
+
 	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
 	if (request_id == (u16) -EBUSY)
 		return -EBUSY;
@@ -3277,15 +4304,17 @@ static int sop_send_sync_cache(struct sop_device *h, struct bio *bio,
 	sop_scatter_gather(h, qinfo, num_sg, r, sgl, &ser->xfer_size);
 
 	r->xfer_size = cpu_to_le32(ser->xfer_size);
-	ser->tmo_slot = sop_add_timeout(qinfo, DEF_IO_TIMEOUT);
+	sop_add_timeout(qinfo, ser, DEF_IO_TIMEOUT * MSEC_PER_SEC);
 	ser->retry_count = 0;
 
-	h->req_flush_bio = req_flush_bio;
-	if (req_flush_bio)
-		h->sync_cache_done = 0;
+	/* Everything that gathered since the last sync rides this one */
+	ser->flush = 1;
+	ser->flush_riders = qinfo->flush_wait;
+	bio_list_init(&qinfo->flush_wait);
+	qinfo->flush_busy = 1;
+
 	sop_start_io_acct(bio);
-	/* Submit it to the device */
-	writew(qinfo->iq->unposted_index, qinfo->iq->index.to_dev.pi);
+	memcpy(ser->iu, r, IQ_IU_SIZE);
 
 	return 0;
 
@@ -3294,28 +4323,29 @@ alloc_elem_fail:
 	return -EBUSY;
 }
 
-static int sop_process_bio(struct sop_device *h, struct bio *bio,
-			   struct queue_info *qinfo)
+/*
+ * Turn a discard bio into UNMAP.  A single inline SG never touches the
+ * request's slot of the pool SGL area, so the parameter list is built
+ * there instead of allocating and mapping a buffer per discard.
+ */
+static int sop_send_unmap(struct sop_device *h, struct bio *bio,
+			  struct queue_info *qinfo)
 {
+	struct sop_request_pool *p = sop_qinfo_pool(qinfo);
 	struct sop_limited_cmd_iu *r;
 	struct sop_request *ser;
-	enum dma_data_direction dma_dir;
+	struct sop_unmap_param_list *param;
 	struct scatterlist *sgl;
+	u64 lba, nblocks;
+	u32 count;
 	u16 request_id;
-	int num_sg;
+	int ndesc, len;
 
-	if (unlikely((bio->bi_rw & REQ_FLUSH) && !h->sync_cache_done)) {
-		/* If no data to transfer, just sync and return */
-		if (!bio_phys_segments(h->rq, bio))
-			return sop_send_sync_cache(h, bio, qinfo, NULL);
-		/*
-		 * Otherwise sync cache and set up to send the data xfer
-		 * when the sync completes successfully.
-		 */ 
-		return sop_send_sync_cache(h, bio, qinfo, bio);
-	}
+	/* Stay within the window the device can currently take */
+	if (atomic_read(&qinfo->cur_qdepth) >= qinfo->depth_limit)
+		return -EBUSY;
 
-	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
+	request_id = alloc_request(h, p);
 	if (request_id == (u16) -EBUSY)
 		return -EBUSY;
 
@@ -3325,44 +4355,51 @@ static int sop_process_bio(struct sop_device *h, struct bio *bio,
 			dev_warn(&h->pdev->dev,
 				"SUBQ[%d] pqi_alloc_elements for bio %p returned %ld\n",
 				qinfo_to_qid(qinfo), bio, PTR_ERR(r));
-		goto alloc_elem_fail;
+		free_request(h, p, request_id);
+		return -EBUSY;
 	}
 
+	/* Pack the range into as few descriptors as the device allows */
+	param = (struct sop_unmap_param_list *)
+			&p->sg[request_id * h->max_sgls];
+	lba = bio->bi_sector;
+	nblocks = bio_sectors(bio);
+	for (ndesc = 0; nblocks; ndesc++) {
+		count = min_t(u64, nblocks, SOP_UNMAP_DESC_BLOCKS);
+		param->desc[ndesc].lba = cpu_to_be64(lba);
+		param->desc[ndesc].nblocks = cpu_to_be32(count);
+		param->desc[ndesc].reserved = 0;
+		lba += count;
+		nblocks -= count;
+	}
+	len = sizeof(*param) + ndesc * sizeof(param->desc[0]);
+	param->data_len = cpu_to_be16(len - 2);
+	param->blk_desc_len = cpu_to_be16(ndesc * sizeof(param->desc[0]));
+	param->reserved = 0;
+
 	r->iu_type = SOP_LIMITED_CMD_IU;
 	r->compatible_features = 0;
 	r->queue_id = cpu_to_le16(qinfo->oq->queue_id);
 	r->work_area = 0;
 	r->request_id = request_id;
-	ser = &h->io_req[qinfo->numa_node].request[request_id];
+	ser = &p->request[request_id];
 	ser->start_time = jiffies;
 	ser->qid = qinfo_to_qid(qinfo);
-	sgl = ser->sgl;
-	ser->xfer_size = 0;
 	ser->bio = bio;
 	ser->waiting = NULL;
+	r->flags = SOP_DATA_DIR_TO_DEVICE;
 
-	/* It has to be a READ or WRITE for BIO */
-	if (bio_data_dir(bio) == WRITE) {
-		r->flags = SOP_DATA_DIR_TO_DEVICE;
-		dma_dir = DMA_TO_DEVICE;
-	} else {
-		r->flags = SOP_DATA_DIR_FROM_DEVICE;
-		dma_dir = DMA_FROM_DEVICE;
-	}
-
-	/* Prepare the CDB Now */
-	sop_prepare_cdb(r->cdb, bio);
-
-	/* Prepare the scatterlist */
-	num_sg = sop_prepare_scatterlist(bio, ser, sgl);
+	memset(r->cdb, 0, sizeof(r->cdb));
+	r->cdb[0] = UNMAP;
+	r->cdb[7] = SOP_GET_BYTE(len, 1);
+	r->cdb[8] = SOP_GET_BYTE(len, 0);
 
-	/* Map the SG */
-	num_sg = dma_map_sg(&h->pdev->dev, sgl, num_sg, dma_dir);
-	if (num_sg < 0) {
-		dev_warn(&h->pdev->dev, "dma_map failure bio %p, SQ[%d].\n",
-			bio, qinfo_to_qid(qinfo));
-		goto sg_map_fail;
-	}
+	/* Part of the coherent pool area, ser->num_sg must remain 0 */
+	sgl = ser->sgl;
+	sgl[0].dma_address = p->sg_bus_addr +
+				request_id * SOP_SGL_SLOT_SIZE(h);
+	sg_dma_len(&sgl[0]) = len;
+	ser->num_sg = 0;
 
 	atomic_inc(&qinfo->cur_qdepth);
 	if (qinfo->max_qdepth < atomic_read(&qinfo->cur_qdepth))
@@ -3370,48 +4407,290 @@ static int sop_process_bio(struct sop_device *h, struct bio *bio,
 	atomic_inc(&h->cmd_pending);
 	if (atomic_read(&h->cmd_pending) > h->max_cmd_pending)
 		h->max_cmd_pending = atomic_read(&h->cmd_pending);
-	ser->num_sg = num_sg;
-#if 0
-	dev_warn(&h->pdev->dev,
-		"CDB: [0]%02x [1]%02x [2]%02x %02x %02x %02x XFER Size: %d, Num Seg %d\n",
-		r->cdb[0], r->cdb[1], r->cdb[2], r->cdb[3],
-		r->cdb[4], r->cdb[5], ser->xfer_size, num_sg);
-#endif
 	ser->log_index = sop_debug_add_log(h, qinfo, request_id, r->cdb[0]);
 
-	sop_scatter_gather(h, qinfo, num_sg, r, sgl, &ser->xfer_size);
+	sop_scatter_gather(h, qinfo, 1, r, sgl, &ser->xfer_size);
 
-	sop_update_io_counters(h, ser, bio);
 	r->xfer_size = cpu_to_le32(ser->xfer_size);
-	ser->tmo_slot = sop_add_timeout(qinfo, DEF_IO_TIMEOUT);
+	sop_add_timeout(qinfo, ser, DEF_IO_TIMEOUT * MSEC_PER_SEC);
 	ser->retry_count = 0;
 
 	sop_start_io_acct(bio);
-	/* Submit it to the device */
-	writew(qinfo->iq->unposted_index, qinfo->iq->index.to_dev.pi);
+	memcpy(ser->iu, r, IQ_IU_SIZE);
 
 	return 0;
-
-sg_map_fail:
-	pqi_unalloc_elements(qinfo->iq, 1);
-
-alloc_elem_fail:
-	free_request(h, &h->io_req[qinfo->numa_node], request_id);
-	return -EBUSY;
 }
 
-static void sop_queue_cmd(struct queue_info *qinfo, struct bio *bio)
+/* Build the IU for a bio, the caller rings the doorbell */
+static int sop_prep_bio(struct sop_device *h, struct bio *bio,
+			struct queue_info *qinfo)
 {
-	bio_list_add(&qinfo->wait_list, bio);
-	qinfo->waitlist_depth++;
-}
+	struct sop_limited_cmd_iu *r;
+	struct sop_request *ser;
+	enum dma_data_direction dma_dir;
+	struct scatterlist *sgl;
+	u16 request_id;
+	int num_sg;
+	int zero;
 
-static MRFN_TYPE sop_make_request(struct request_queue *q, struct bio *bio)
-{
+	/*
+	 * Sync first, any data goes out once the sync completed.  A sync
+	 * already in flight may predate writes this flush has to cover,
+	 * so while there is one the flush gathers for the next.
+	 */
+	if (unlikely(bio->bi_rw & REQ_FLUSH)) {
+		if (!qinfo->flush_busy)
+			return sop_send_sync_cache(h, bio, qinfo);
+		bio_list_add(&qinfo->flush_wait, bio);
+		return 0;
+	}
+
+	if (bio->bi_rw & REQ_DISCARD)
+		return sop_send_unmap(h, bio, qinfo);
+
+	/* Stay within the window the device can currently take */
+	if (atomic_read(&qinfo->cur_qdepth) >= qinfo->depth_limit)
+		return -EBUSY;
+
+	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
+	if (request_id == (u16) -EBUSY)
+		return -EBUSY;
+
+	r = pqi_alloc_elements(qinfo->iq, 1);
+	if (IS_ERR(r)) {
+		if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
+			dev_warn(&h->pdev->dev,
+				"SUBQ[%d] pqi_alloc_elements for bio %p returned %ld\n",
+				qinfo_to_qid(qinfo), bio, PTR_ERR(r));
+		goto alloc_elem_fail;
+	}
+
+	r->iu_type = SOP_LIMITED_CMD_IU;
+	r->compatible_features = 0;
+	r->queue_id = cpu_to_le16(qinfo->oq->queue_id);
+	r->work_area = 0;
+	r->request_id = request_id;
+	ser = &h->io_req[qinfo->numa_node].request[request_id];
+	ser->start_time = jiffies;
+	ser->qid = qinfo_to_qid(qinfo);
+	sgl = ser->sgl;
+	ser->xfer_size = 0;
+	ser->bio = bio;
+	ser->waiting = NULL;
+	zero = sop_zero_write(h, bio);
+
+	/* It has to be a READ or WRITE for BIO */
+	if (bio_data_dir(bio) == WRITE) {
+		r->flags = SOP_DATA_DIR_TO_DEVICE;
+		dma_dir = DMA_TO_DEVICE;
+	} else {
+		r->flags = SOP_DATA_DIR_FROM_DEVICE;
+		dma_dir = DMA_FROM_DEVICE;
+	}
+
+	if (unlikely(zero)) {
+		/* One zeroed block from the request's pool SGL slot */
+		struct sop_request_pool *p = sop_qinfo_pool(qinfo);
+
+		sop_prepare_write_same_cdb(h, r->cdb, bio, 1);
+		if (unlikely(h->nr_wgroups))
+			sop_set_write_group(h, r->cdb, bio);
+		memset(&p->sg[request_id * h->max_sgls], 0, h->block_size);
+		sgl[0].dma_address = p->sg_bus_addr +
+					request_id * SOP_SGL_SLOT_SIZE(h);
+		sg_dma_len(&sgl[0]) = h->block_size;
+		num_sg = 1;
+		/* Nothing was mapped, ser->num_sg must remain 0 */
+		ser->num_sg = 0;
+		atomic_inc(&h->zero_writes);
+		atomic64_add(bio->bi_size - h->block_size,
+				&h->zero_bytes_elided);
+		goto sg_ready;
+	}
+
+	/* Prepare the CDB Now */
+	if (unlikely(bio->bi_rw & REQ_WRITE_SAME))
+		sop_prepare_write_same_cdb(h, r->cdb, bio,
+					   sop_bio_is_zero(bio));
+	else
+		sop_prepare_cdb(r->cdb, bio);
+	if (unlikely(h->nr_wgroups) && bio_data_dir(bio) == WRITE)
+		sop_set_write_group(h, r->cdb, bio);
+
+	/* Prepare the scatterlist */
+	if (unlikely(bio_integrity(bio))) {
+		num_sg = sop_prepare_pi_scatterlist(h, bio, sgl);
+		if (num_sg < 0)
+			goto pi_fail;
+		r->cdb[1] |= SOP_RWPROTECT;
+	} else
+		num_sg = sop_prepare_scatterlist(bio, ser, sgl);
+
+	/* Map the SG */
+	num_sg = dma_map_sg(&h->pdev->dev, sgl, num_sg, dma_dir);
+	if (num_sg < 0) {
+		dev_warn(&h->pdev->dev, "dma_map failure bio %p, SQ[%d].\n",
+			bio, qinfo_to_qid(qinfo));
+		goto sg_map_fail;
+	}
+	ser->num_sg = num_sg;
+
+sg_ready:
+
+	atomic_inc(&qinfo->cur_qdepth);
+	if (qinfo->max_qdepth < atomic_read(&qinfo->cur_qdepth))
+		qinfo->max_qdepth = atomic_read(&qinfo->cur_qdepth);
+	atomic_inc(&h->cmd_pending);
+	if (atomic_read(&h->cmd_pending) > h->max_cmd_pending)
+		h->max_cmd_pending = atomic_read(&h->cmd_pending);
+#if 0
+	dev_warn(&h->pdev->dev,
+		"CDB: [0]%02x [1]%02x [2]%02x %02x %02x %02x XFER Size: %d, Num Seg %d\n",
+		r->cdb[0], r->cdb[1], r->cdb[2], r->cdb[3],
+		r->cdb[4], r->cdb[5], ser->xfer_size, num_sg);
+#endif
+	ser->log_index = sop_debug_add_log(h, qinfo, request_id, r->cdb[0]);
+
+	sop_scatter_gather(h, qinfo, num_sg, r, sgl, &ser->xfer_size);
+
+	sop_update_io_counters(h, ser, bio);
+	r->xfer_size = cpu_to_le32(ser->xfer_size);
+	sop_add_timeout(qinfo, ser, DEF_IO_TIMEOUT * MSEC_PER_SEC);
+	ser->retry_count = 0;
+
+	sop_start_io_acct(bio);
+	memcpy(ser->iu, r, IQ_IU_SIZE);
+
+	return 0;
+
+sg_map_fail:
+	pqi_unalloc_elements(qinfo->iq, 1);
+
+alloc_elem_fail:
+	free_request(h, &h->io_req[qinfo->numa_node], request_id);
+	return -EBUSY;
+
+pi_fail:
+	/*
+	 * Retrying will not make it fit: -EIO tells the caller to fail it
+	 * rather than requeue, once it dropped the queue lock.
+	 */
+	dev_warn(&h->pdev->dev, "bio %p: PI does not fit in %d SGLs\n",
+		bio, h->max_sgls);
+	pqi_unalloc_elements(qinfo->iq, 1);
+	free_request(h, &h->io_req[qinfo->numa_node], request_id);
+	return -EIO;
+}
+
+static int sop_process_bio(struct sop_device *h, struct bio *bio,
+			   struct queue_info *qinfo)
+{
+	int rc = sop_prep_bio(h, bio, qinfo);
+
+	/* Submit it to the device */
+	if (!rc)
+		writew(qinfo->iq->unposted_index, qinfo->iq->index.to_dev.pi);
+	return rc;
+}
+
+static void sop_queue_cmd(struct queue_info *qinfo, struct bio *bio)
+{
+	bio_list_add(&qinfo->wait_list, bio);
+	qinfo->waitlist_depth++;
+	sop_wait_enter(qinfo, 1, 0);
+	sop_arm_drain(qinfo);
+}
+
+/*
+ * Keep bios from growing across a split_sectors boundary.  The first
+ * page is always accepted, so a bio may still straddle one boundary.
+ */
+static int sop_merge_bvec(struct request_queue *q, struct bvec_merge_data *bvm,
+			  struct bio_vec *bv)
+{
+	struct sop_device *h = q->queuedata;
+	sector_t sector = bvm->bi_sector + get_start_sect(bvm->bi_bdev);
+	unsigned int bio_sectors = bvm->bi_size >> 9;
+	unsigned int chunk = h->split_sectors;
+	int max;
+
+	if (!chunk)
+		return bv->bv_len;
+
+	max = (chunk - sector_div(sector, chunk) - bio_sectors) << 9;
+	if (max < 0)
+		max = 0;
+	if (max <= bv->bv_len && bio_sectors == 0)
+		return bv->bv_len;
+	return max;
+}
+
+/* Sectors up to the boundary a single page bio straddles, else 0 */
+static unsigned int sop_split_point(struct sop_device *h, struct bio *bio)
+{
+	unsigned int chunk = h->split_sectors;
+	sector_t sector = bio->bi_sector;
+	unsigned int first;
+
+	if (!chunk || bio->bi_vcnt != 1 || bio->bi_idx ||
+	    (bio->bi_rw & (REQ_FLUSH | REQ_DISCARD | REQ_WRITE_SAME)))
+		return 0;
+
+	first = chunk - sector_div(sector, chunk);
+	return (first < bio_sectors(bio)) ? first : 0;
+}
+
+/* Post both halves of a straddling bio back to back, one doorbell */
+static void sop_make_split_request(struct sop_device *h, struct bio *bio,
+				   unsigned int first)
+{
+	struct queue_info *qinfo;
+	struct bio_pair *bp;
+	struct bio *half[2], *failed[2];
+	int i, rc, posted = 0, nfailed = 0;
+
+	bp = bio_split(bio, first);
+	half[0] = &bp->bio1;
+	half[1] = &bp->bio2;
+
+	/* The pair ends the original, each half completes on its own */
+	atomic_inc(&h->bio_count);
+
+	qinfo = &h->qinfo[find_sop_queue(h, get_cpu())];
+	spin_lock_irq(&qinfo->iq->qlock);
+	for (i = 0; i < 2; i++) {
+		rc = -EBUSY;
+		/* Once one half is queued the other must follow it */
+		if (posted + nfailed == i &&
+		    bio_list_empty(&qinfo->wait_list) && !SOP_DEVICE_BUSY(h))
+			rc = sop_prep_bio(h, half[i], qinfo);
+		if (!rc)
+			posted++;
+		else if (rc == -EIO)
+			failed[nfailed++] = half[i];
+		else
+			sop_queue_cmd(qinfo, half[i]);
+	}
+	if (posted)
+		writew(qinfo->iq->unposted_index, qinfo->iq->index.to_dev.pi);
+	spin_unlock_irq(&qinfo->iq->qlock);
+	put_cpu();
+
+	for (i = 0; i < nfailed; i++) {
+		atomic_dec(&h->bio_count);
+		bio_endio(failed[i], -EIO);
+	}
+
+	bio_pair_release(bp);
+}
+
+static MRFN_TYPE sop_make_request(struct request_queue *q, struct bio *bio)
+{
 	struct sop_device *h = q->queuedata;
 	int result;
 	int cpu;
 	int qpindex;
+	unsigned int split;
 	struct queue_info *qinfo;
 
 	atomic_inc(&h->bio_count);
@@ -3423,6 +4702,13 @@ static MRFN_TYPE sop_make_request(struct request_queue *q, struct bio *bio)
 		return MRFN_RET;
 	}
 
+	/* No command may cross a device preferred boundary */
+	split = sop_split_point(h, bio);
+	if (unlikely(split)) {
+		sop_make_split_request(h, bio, split);
+		return MRFN_RET;
+	}
+
 	/* Prepare the SOP IU and fire */
 	cpu = get_cpu();
 
@@ -3433,17 +4719,23 @@ static MRFN_TYPE sop_make_request(struct request_queue *q, struct bio *bio)
 	spin_lock_irq(&qinfo->iq->qlock);
 
 	result = -EBUSY;
-	if (bio_list_empty(&qinfo->wait_list))
+	if (bio_list_empty(&qinfo->wait_list) && !SOP_DEVICE_BUSY(h))
 		/* Try to submit the command */
 		result = sop_process_bio(h, bio, qinfo);
 
-	if (unlikely(result))
+	if (unlikely(result) && result != -EIO)
 		sop_queue_cmd(qinfo, bio);
 
 	spin_unlock_irq(&qinfo->iq->qlock);
 
 	put_cpu();
 
+	/* Could not be prepared at all, retrying will not help */
+	if (unlikely(result == -EIO)) {
+		atomic_dec(&h->bio_count);
+		bio_endio(bio, -EIO);
+	}
+
 	return MRFN_RET;
 }
 
@@ -3654,7 +4946,7 @@ static int process_direct_cdb_response(struct sop_device *h,
 {
 	int retval = -1;
 
-	sop_rem_timeout(qinfo, sopr->tmo_slot);
+	sop_rem_timeout(qinfo, sopr);
 	if (sio->data_dir != DMA_NONE) {
 		struct scatterlist *sgl;
 		int i;
@@ -3668,10 +4960,41 @@ static int process_direct_cdb_response(struct sop_device *h,
 	}
 	retval = sop_complete_sgio_hdr(h, sio, sopr);
 
-	free_request(h, &h->io_req[qinfo->numa_node], sopr->request_id);
+	free_request(h, sop_qinfo_pool(qinfo), sopr->request_id);
+	wake_up(&h->mgmt_wait);
+	if (qinfo_to_qid(qinfo) != h->mgmt_qpindex)
+		sop_kick_node_wait_lists(h, qinfo->numa_node);
 	return retval;
 }
 
+/*
+ * Describe len bytes at offset of an already DMA mapped buffer in at
+ * most max entries of sgl.  Returns the number of entries used.
+ */
+static int sop_fill_mapped_sgl(struct scatterlist *sgl, int max,
+			       struct scatterlist *src, int src_nsegs,
+			       u64 offset, u32 len)
+{
+	int i, n = 0;
+	u32 seg_len;
+
+	for (i = 0; i < src_nsegs && len; i++) {
+		if (offset >= sg_dma_len(&src[i])) {
+			offset -= sg_dma_len(&src[i]);
+			continue;
+		}
+		if (n == max)
+			return -EINVAL;
+		seg_len = min_t(u64, sg_dma_len(&src[i]) - offset, len);
+		sgl[n].dma_address = sg_dma_address(&src[i]) + offset;
+		sg_dma_len(&sgl[n]) = seg_len;
+		len -= seg_len;
+		offset = 0;
+		n++;
+	}
+	return len ? -EINVAL : n;
+}
+
 static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 			 dma_addr_t phy_addr)
 {
@@ -3679,9 +5002,11 @@ static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 	struct queue_info *qinfo;
 	struct sop_request *ser;
 	struct sop_limited_cmd_iu *r;
-	int request_id, cpu;
+	struct sop_request_pool *pool;
+	int request_id;
 	int retval = -EIO;
 	int nsegs = 0;
+	long wait;
 	struct scatterlist *sgl, *sgl_buffer;
 	sg_io_hdr_t *hdr = sio->sg_hdr;
 
@@ -3739,26 +5064,44 @@ static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 		nsegs = retval;
 	}
 
-	cpu = get_cpu();
-	queue_pair_index = find_sop_queue(h, cpu);
+	queue_pair_index = sop_mgmt_qpindex(h);
 	qinfo = &h->qinfo[queue_pair_index];
-	spin_lock_irq(&qinfo->iq->qlock);
-	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
-	if (request_id == (u16) -EBUSY) {
+	pool = sop_qinfo_pool(qinfo);
+	for (;;) {
+		get_cpu();
+		spin_lock_irq(&qinfo->iq->qlock);
+		request_id = (u16) -EBUSY;
+		if (sio->lock_op || !sop_mgmt_reserved(h, pool))
+			request_id = alloc_request(h, pool);
+		if (request_id != (u16) -EBUSY) {
+			r = pqi_alloc_elements(qinfo->iq, 1);
+			if (!IS_ERR(r))
+				break;
+			free_request(h, pool, request_id);
+		}
+		spin_unlock_irq(&qinfo->iq->qlock);
+		put_cpu();
+
+		/*
+		 * Queue full: sleep until a command completes, don't fail.
+		 * Nothing wakes us when the device frees IQ elements, so
+		 * this is a poll every SOP_MGMT_WAIT_MS then.
+		 */
 		if ((sop_dbg_lvl & SOP_DBG_LVL_RARE_NORM_EVENT))
 			dev_warn(&h->pdev->dev,
-				"%s: Failed to allocate request\n", __func__);
-		goto sync_req_id_fail;
-	}
-	r = pqi_alloc_elements(qinfo->iq, 1);
-	if (IS_ERR(r)) {
-		if ((sop_dbg_lvl & SOP_DBG_LVL_EXTRA_WARN))
-			dev_warn(&h->pdev->dev,
-			"SUBQ[%d] pqi_alloc_elements for CDB 0x%x returned %ld\n",
-			queue_pair_index, sio->cdb[0], PTR_ERR(r));
-		goto sync_alloc_elem_fail;
+				"%s: SUBQ[%d] full for CDB 0x%x, waiting\n",
+				__func__, queue_pair_index, sio->cdb[0]);
+		wait = wait_event_interruptible_timeout(h->mgmt_wait,
+				sop_mgmt_has_room(h, qinfo, pool,
+						  sio->lock_op) ||
+				SOP_DEVICE_REM(h),
+				msecs_to_jiffies(SOP_MGMT_WAIT_MS));
+		if (wait < 0 || SOP_DEVICE_REM(h)) {
+			retval = (wait < 0) ? wait : -EIO;
+			goto sync_error;
+		}
 	}
-	ser = &h->io_req[qinfo->numa_node].request[request_id];
+	ser = &pool->request[request_id];
 	/* Init fields of sop request context */
 	ser->start_time = jiffies;
 	ser->qid = queue_pair_index;
@@ -3772,6 +5115,7 @@ static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 			/* Copy and free the temporary sgl buffer */
 			memcpy(sgl, sgl_buffer, sizeof(*sgl) * h->max_sgls);
 			kfree(sgl_buffer);
+			sgl_buffer = NULL;
 
 			ser->num_sg = nsegs;
 			nsegs = dma_map_sg(&h->pdev->dev, sgl, nsegs,
@@ -3783,6 +5127,13 @@ static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 					qinfo_to_qid(qinfo));
 				goto sync_dma_map_fail;
 			}
+		} else if (sio->rsv_sgl) {
+			/* Mapped once at mmap, ser->num_sg must remain 0 */
+			nsegs = sop_fill_mapped_sgl(sgl, h->max_sgls,
+					sio->rsv_sgl, sio->rsv_nsegs, 0,
+					sio->data_len);
+			if (nsegs <= 0)
+				goto sync_dma_map_fail;
 		} else {
 			/* Prepare single SG */
 			nsegs = 1;
@@ -3800,18 +5151,14 @@ static int send_sync_cdb(struct sop_device *h, struct sop_sync_cdb_req *sio,
 				request_id, sio->cdb, sio->cdblen,
 				ser->xfer_size, sio->data_dir);
 
-	ser->tmo_slot = sop_add_timeout(qinfo, sio->timeout);
+	sop_add_timeout(qinfo, ser, sio->timeout_ms);
 	ser->retry_count = 0;
 	send_sop_command(h, qinfo, ser);
 	return process_direct_cdb_response(h, sio, qinfo, ser);
 
 sync_dma_map_fail:
 	pqi_unalloc_elements(qinfo->iq, 1);
-
-sync_alloc_elem_fail:
-	free_request(h, &h->io_req[qinfo->numa_node], request_id);
-
-sync_req_id_fail:
+	free_request(h, pool, request_id);
 	spin_unlock_irq(&qinfo->iq->qlock);
 	put_cpu();
 
@@ -3841,7 +5188,7 @@ static void sop_stop_unit(struct sop_device *h)
 	struct sop_sync_cdb_req sio;
 
 	memset(&sio, 0, sizeof(sio));
-	sio.timeout = DEF_IO_TIMEOUT;
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
 	sio.cdb[0] = START_STOP;
 	sio.cdb[1] = 0x01; /* return immediately */
 	sio.cdb[4] = 0x00; /* stop motor */
@@ -3874,80 +5221,708 @@ static inline u32 extract_be32(unsigned char *buff, int offset)
 	return be32_to_cpu(value);
 }
 
+static inline u64 extract_be64(unsigned char *buff, int offset)
+{
+	u64 value;
+
+	memcpy(&value, &buff[offset], sizeof(u64));
+	return be64_to_cpu(value);
+}
+
 #define	MAX_CDB_SIZE	16
-static int sop_get_disk_params(struct sop_device *h)
+#define	SOP_CACHING_PAGE		0x08
+#define	SOP_CACHING_PAGE_LEN		20
+#define	SOP_CACHING_WCE			0x04
+#define	SOP_MODE_DPOFUA			0x10
+#define	SOP_MODE_BUF_LEN		64
+#define	SOP_INQ_3PC			0x08
+
+/* Token based copy offload, SBC-3 */
+#define	SOP_TPC_OUT			0x83
+#define	SOP_TPC_IN			0x84
+#define	SOP_SA_POPULATE_TOKEN		0x10
+#define	SOP_SA_WRITE_USING_TOKEN	0x11
+#define	SOP_SA_RECEIVE_ROD_TOKEN_INFO	0x07
+#define	SOP_ROD_TOKEN_LEN		512
+#define	SOP_WUT_TOKEN_OFF		16	/* in the WRITE USING TOKEN list */
+#define	SOP_WUT_DESC_OFF		536
+#define	SOP_WUT_DEL_TKN			0x02
+#define	SOP_COPY_BUF_LEN		1024
+#define	SOP_COPY_CHUNK_BLOCKS		(1U << 16)	/* per token */
+#define	SOP_COPY_TIMEOUT		120		/* seconds */
+#define	SOP_COPY_BOUNCE_BYTES		(256 * 1024)
+#define	SOP_CAW_FUA_BIT			0x08
+#define	SOP_WRITE_ATOMIC_16		0x9c
+#define	SOP_VPD_B0_ATOMIC_LEN		0x3c
+
+/* Media scrub */
+#define	SOP_VERIFY_16			0x8f
+#define	SOP_SCRUB_CHUNK_BLOCKS		2048	/* per VERIFY */
+#define	SOP_SCRUB_NARROW_BLOCKS		8	/* bad ranges come in these */
+#define	SOP_SCRUB_BUSY_MS		1000
+
+/*
+ * Read the current caching mode page with MODE SENSE(10) into buf.
+ * Returns the offset of the page in buf, or a negative error.
+ */
+static int sop_mode_sense_caching(struct sop_device *h, unsigned char *buf,
+				  dma_addr_t phy_addr)
 {
-	int ret;
-	dma_addr_t phy_addr;
-	void *vaddr;
-	int total_size;
-	u32 *data;
-	int retry_count;
 	struct sop_sync_cdb_req sio;
-	sector_t size_mask;
-	u32 opt_xfer_len_granularity;
-	u32 max_xfer_len;
-	u32 opt_xfer_len;
-	u32 max_prefetch_xdrdwr_xfer_len;
-	u32 max_unmap_lba_count;
-	u32 max_unmap_blk_desc_count;
-
-	/* 0. Allocate memory */
-	total_size = 1024;
-	vaddr = pci_alloc_consistent(h->pdev, total_size, &phy_addr);
-	if (!vaddr)
-		return -ENOMEM;
-	data = (u32 *)vaddr;
+	int off;
 
-	/* Initialize the sync cdb struct */
 	memset(&sio, 0, sizeof(sio));
-	sio.timeout = DEF_IO_TIMEOUT;
-
-	/* 0.1. Send Inquiry */
-	sio.data_len = 36;
-	sio.cdb[0] = INQUIRY;		/* Rest all remains 0 */
-	sio.cdb[4] = sio.data_len;
-	sio.cdblen = COMMAND_SIZE(INQUIRY);
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.data_len = SOP_MODE_BUF_LEN;
+	sio.cdb[0] = MODE_SENSE_10;
+	sio.cdb[1] = 0x08;		/* DBD */
+	sio.cdb[2] = SOP_CACHING_PAGE;	/* PC 0: current values */
+	sio.cdb[7] = SOP_GET_BYTE(sio.data_len, 1);
+	sio.cdb[8] = SOP_GET_BYTE(sio.data_len, 0);
+	sio.cdblen = COMMAND_SIZE(MODE_SENSE_10);
 	sio.data_dir = DMA_FROM_DEVICE;
-	ret = send_sync_cdb(h, &sio, phy_addr);
-	if (ret != 0)
-		goto disk_param_err;
+	if (send_sync_cdb(h, &sio, phy_addr))
+		return -EIO;
 
-	/* 0.2. Get inquiry vpd page 0xb0 -- block limits */
-	sio.data_len = 36;
-	sio.cdb[0] = INQUIRY;		/* Rest all remains 0 */
-	sio.cdb[1] = 0x01; /* EVPD */
-	sio.cdb[2] = 0xb0; /* block limits page */
-	sio.cdb[4] = sio.data_len;
-	sio.cdblen = COMMAND_SIZE(INQUIRY);
-	sio.data_dir = DMA_FROM_DEVICE;
-	ret = send_sync_cdb(h, &sio, phy_addr);
-	if (ret == 0) {
-		unsigned char *buf = vaddr;
+	off = 8 + ((buf[6] << 8) | buf[7]);
+	if (off + SOP_CACHING_PAGE_LEN > SOP_MODE_BUF_LEN ||
+	    (buf[off] & 0x3f) != SOP_CACHING_PAGE)
+		return -EIO;
+	return off;
+}
 
-		opt_xfer_len_granularity = (buf[6] << 8) | buf[7];
-		max_xfer_len = extract_be32(buf, 8);
-		opt_xfer_len = extract_be32(buf, 12);
-		max_prefetch_xdrdwr_xfer_len = extract_be32(buf, 16);
-		max_unmap_lba_count = extract_be32(buf, 20);
-		max_unmap_blk_desc_count = extract_be32(buf, 24);
-	} else {
-		opt_xfer_len_granularity = 0;
-		max_xfer_len = BLK_SAFE_MAX_SECTORS;
-		opt_xfer_len = 8;
-		max_prefetch_xdrdwr_xfer_len = 0;
-		max_unmap_lba_count = 0;
-		max_unmap_blk_desc_count = 0;
+/* Without a caching page assume a volatile cache and keep flushing */
+static void sop_read_cache_mode(struct sop_device *h, unsigned char *buf,
+				dma_addr_t phy_addr)
+{
+	int off = sop_mode_sense_caching(h, buf, phy_addr);
+
+	if (off < 0) {
+		h->wce = 1;
+		h->dpofua = 1;
+		return;
 	}
-	if (max_xfer_len)
-		h->max_hw_sectors = max_xfer_len;
+	h->wce = !!(buf[off + 2] & SOP_CACHING_WCE);
+	h->dpofua = !!(buf[3] & SOP_MODE_DPOFUA);
+}
+
+/* Flush and FUA only mean something with a volatile write cache */
+static void sop_set_write_cache(struct sop_device *h)
+{
+	unsigned int flush = 0;
+
+	if (h->wce) {
+		flush = REQ_FLUSH;
+		if (h->dpofua)
+			flush |= REQ_FUA;
+	}
+	blk_queue_flush(h->rq, flush);
+}
+
+/* Turn the volatile write cache on or off with MODE SELECT(10) */
+static int sop_select_write_cache(struct sop_device *h, int wce)
+{
+	struct sop_sync_cdb_req sio;
+	unsigned char *buf;
+	dma_addr_t phy_addr;
+	int off, len, ret;
+
+	buf = pci_alloc_consistent(h->pdev, SOP_MODE_BUF_LEN, &phy_addr);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = off = sop_mode_sense_caching(h, buf, phy_addr);
+	if (off < 0)
+		goto select_out;
+
+	/* Mode data length and PS are reserved for MODE SELECT */
+	len = off + SOP_CACHING_PAGE_LEN;
+	buf[0] = 0;
+	buf[1] = 0;
+	buf[3] = 0;
+	buf[off] &= 0x3f;
+	if (wce)
+		buf[off + 2] |= SOP_CACHING_WCE;
 	else
-		h->max_hw_sectors = BLK_SAFE_MAX_SECTORS;
+		buf[off + 2] &= ~SOP_CACHING_WCE;
 
-	retry_count = 0;
-sync_send_tur:
-	/* 1. send TUR */
-	memset(sio.cdb, 0, MAX_CDB_SIZE);
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.data_len = len;
+	sio.cdb[0] = MODE_SELECT_10;
+	sio.cdb[1] = 0x10;		/* PF */
+	sio.cdb[7] = SOP_GET_BYTE(len, 1);
+	sio.cdb[8] = SOP_GET_BYTE(len, 0);
+	sio.cdblen = COMMAND_SIZE(MODE_SELECT_10);
+	sio.data_dir = DMA_TO_DEVICE;
+	ret = send_sync_cdb(h, &sio, phy_addr) ? -EIO : 0;
+	if (ret)
+		goto select_out;
+
+	/* Take what the device now reports, it may have refused */
+	sop_read_cache_mode(h, buf, phy_addr);
+	sop_set_write_cache(h);
+
+select_out:
+	pci_free_consistent(h->pdev, SOP_MODE_BUF_LEN, buf, phy_addr);
+	return ret;
+}
+
+static ssize_t sop_show_write_cache(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+
+	return snprintf(buf, SOP_MAX_LINE_LEN, "%u\n", h->wce);
+}
+
+static ssize_t sop_store_write_cache(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	unsigned int wce;
+	int ret;
+
+	if (sscanf(buf, "%u", &wce) < 1 || wce > 1) {
+		pr_err("sop: could not set write_cache from \'%s\'\n", buf);
+		return -EINVAL;
+	}
+	ret = sop_select_write_cache(h, wce);
+	if (ret)
+		return ret;
+	return (h->wce == wce) ? count : -EIO;
+}
+
+static DEVICE_ATTR(write_cache, S_IRUGO|S_IWUSR, sop_show_write_cache,
+		   sop_store_write_cache);
+
+static ssize_t sop_show_integrity(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+
+	return snprintf(buf, SOP_MAX_LINE_LEN, "%u\n", h->pi_enabled);
+}
+
+static ssize_t sop_store_integrity(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	struct block_device *bdev;
+	unsigned int on;
+	int ret;
+
+	if (sscanf(buf, "%u", &on) < 1 || on > 1) {
+		pr_err("sop: could not set integrity from \'%s\'\n", buf);
+		return -EINVAL;
+	}
+
+	/* Opening takes bd_mutex, holding it keeps the queue idle */
+	bdev = bdget_disk(h->disk, 0);
+	if (!bdev)
+		return -ENOMEM;
+	mutex_lock(&bdev->bd_mutex);
+	if (bdev->bd_openers)
+		ret = -EBUSY;
+	else
+		ret = sop_set_integrity(h, on);
+	mutex_unlock(&bdev->bd_mutex);
+	bdput(bdev);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(integrity, S_IRUGO|S_IWUSR, sop_show_integrity,
+		   sop_store_integrity);
+
+/*
+ * VERIFY(16) with BYTCHK 0: the device reads the blocks back and checks
+ * them against its own ECC, nothing crosses the bus.  -EIO is a medium
+ * error, -EAGAIN the device being busy, -EOPNOTSUPP anything else.
+ */
+static int sop_scrub_verify(struct sop_device *h, u64 lba, u32 n)
+{
+	struct sop_sync_cdb_req sio;
+	int i, ret;
+
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.cdb[0] = SOP_VERIFY_16;
+	for (i = 0; i < 8; i++)
+		sio.cdb[2 + i] = SOP_GET_BYTE(lba, 7 - i);
+	for (i = 0; i < 4; i++)
+		sio.cdb[10 + i] = SOP_GET_BYTE(n, 3 - i);
+	sio.cdblen = 16;
+	sio.data_dir = DMA_NONE;
+
+	ret = send_sync_cdb(h, &sio, 0);
+	if (!ret)
+		return 0;
+	if (ret == -EAGAIN)
+		return -EAGAIN;
+	if (sio.scsi_status == SAM_STAT_CHECK_CONDITION) {
+		switch (sio.sense_key & 0x0f) {
+		case MEDIUM_ERROR:
+		case HARDWARE_ERROR:
+			return -EIO;
+		case NOT_READY:
+		case UNIT_ATTENTION:
+			return -EAGAIN;
+		}
+	}
+	return -EOPNOTSUPP;
+}
+
+/* Called with scrub_lock held, adjoining ranges are merged */
+static void sop_scrub_add_bad(struct sop_device *h, u64 lba, u32 n)
+{
+	struct sop_scrub_range *last;
+
+	if (h->scrub_nbad) {
+		last = &h->scrub_bad[h->scrub_nbad - 1];
+		if (last->lba <= lba && lba <= last->lba + last->nblocks) {
+			last->nblocks = max_t(u64, last->lba + last->nblocks,
+						lba + n) - last->lba;
+			return;
+		}
+	}
+	if (h->scrub_nbad == SOP_SCRUB_MAX_BAD) {
+		h->scrub_dropped++;
+		return;
+	}
+	h->scrub_bad[h->scrub_nbad].lba = lba;
+	h->scrub_bad[h->scrub_nbad].nblocks = n;
+	h->scrub_nbad++;
+}
+
+/* Verify a chunk, narrowing a failure down to the blocks that failed */
+static int sop_scrub_chunk(struct sop_device *h, u64 lba, u32 n)
+{
+	u32 i, step;
+	int ret;
+
+	ret = sop_scrub_verify(h, lba, n);
+	if (ret != -EIO)
+		return ret;
+
+	for (i = 0; i < n; i += step) {
+		step = min_t(u32, n - i, SOP_SCRUB_NARROW_BLOCKS);
+		ret = sop_scrub_verify(h, lba + i, step);
+		if (ret == -EIO) {
+			dev_warn(&h->pdev->dev,
+				"scrub: medium error at LBA %llu+%u\n",
+				lba + i, step);
+			spin_lock(&h->scrub_lock);
+			sop_scrub_add_bad(h, lba + i, step);
+			spin_unlock(&h->scrub_lock);
+		} else if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void sop_scrub_wq(struct work_struct *work)
+{
+	struct sop_device *h = container_of(to_delayed_work(work),
+					struct sop_device, scrub_work);
+	unsigned long delay = 0;
+	u64 lba;
+	u32 n;
+	int ret;
+
+	spin_lock(&h->scrub_lock);
+	if (!h->scrub_running) {
+		spin_unlock(&h->scrub_lock);
+		return;
+	}
+	lba = h->scrub_next;
+	n = min_t(u64, h->scrub_end - lba, SOP_SCRUB_CHUNK_BLOCKS);
+	spin_unlock(&h->scrub_lock);
+
+	ret = sop_scrub_chunk(h, lba, n);
+
+	spin_lock(&h->scrub_lock);
+	if (ret == -EAGAIN) {
+		/* Try the same chunk again once the device settled */
+		delay = msecs_to_jiffies(SOP_SCRUB_BUSY_MS);
+	} else if (ret) {
+		dev_warn(&h->pdev->dev, "scrub: VERIFY failed at LBA %llu, stopped\n",
+			lba);
+		h->scrub_running = 0;
+	} else {
+		h->scrub_next = lba + n;
+		if (h->scrub_next >= h->scrub_end) {
+			dev_warn(&h->pdev->dev,
+				"scrub: done, %u bad range(s)\n",
+				h->scrub_nbad + h->scrub_dropped);
+			h->scrub_running = 0;
+		}
+		/* Space the chunks out to stay within scrub_rate */
+		if (h->scrub_rate)
+			delay = msecs_to_jiffies(div64_u64((u64) n *
+					h->block_size * MSEC_PER_SEC,
+					(u64) h->scrub_rate << 20));
+	}
+	if (h->scrub_running)
+		queue_delayed_work(h->wq, &h->scrub_work, delay);
+	spin_unlock(&h->scrub_lock);
+}
+
+static int sop_scrub_start(struct sop_device *h, u64 lba, u64 n)
+{
+	if (!h->capacity || lba >= h->capacity)
+		return -EINVAL;
+	if (!n || n > h->capacity - lba)
+		n = h->capacity - lba;
+
+	spin_lock(&h->scrub_lock);
+	if (h->scrub_running) {
+		spin_unlock(&h->scrub_lock);
+		return -EBUSY;
+	}
+	h->scrub_next = lba;
+	h->scrub_end = lba + n;
+	h->scrub_nbad = 0;
+	h->scrub_dropped = 0;
+	h->scrub_running = 1;
+	queue_delayed_work(h->wq, &h->scrub_work, 0);
+	spin_unlock(&h->scrub_lock);
+	return 0;
+}
+
+static void sop_scrub_stop(struct sop_device *h)
+{
+	spin_lock(&h->scrub_lock);
+	h->scrub_running = 0;
+	spin_unlock(&h->scrub_lock);
+	cancel_delayed_work_sync(&h->scrub_work);
+}
+
+/*
+ * A reset or PCI error stops the scrub where it is.  Not waiting for a
+ * chunk in progress: its VERIFY may be one the reset has to complete.
+ */
+static void sop_scrub_cancel(struct sop_device *h)
+{
+	spin_lock(&h->scrub_lock);
+	if (h->scrub_running)
+		dev_warn(&h->pdev->dev,
+			"scrub: stopped by reset at LBA %llu\n",
+			h->scrub_next);
+	h->scrub_running = 0;
+	spin_unlock(&h->scrub_lock);
+	cancel_delayed_work(&h->scrub_work);
+}
+
+static ssize_t sop_show_scrub(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	ssize_t len;
+	u32 i;
+
+	spin_lock(&h->scrub_lock);
+	len = scnprintf(buf, PAGE_SIZE,
+			"state %s\nnext_lba %llu\nend_lba %llu\n",
+			h->scrub_running ? "running" : "stopped",
+			h->scrub_next, h->scrub_end);
+	for (i = 0; i < h->scrub_nbad; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "bad %llu %u\n",
+				h->scrub_bad[i].lba,
+				h->scrub_bad[i].nblocks);
+	if (h->scrub_dropped)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"bad_not_listed %u\n", h->scrub_dropped);
+	spin_unlock(&h->scrub_lock);
+	return len;
+}
+
+/* "start [lba [nblocks]]" or "stop" */
+static ssize_t sop_store_scrub(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	unsigned long long lba = 0, n = 0;
+	int ret, pos = 0;
+
+	if (sysfs_streq(buf, "stop")) {
+		sop_scrub_stop(h);
+		return count;
+	}
+	/*
+	 * "start", "start LBA" or "start LBA N" and nothing else: pos ends
+	 * up past the last number converted, only blanks may follow.
+	 */
+	if (!strncmp(buf, "start", 5) && (!buf[5] || isspace(buf[5])))
+		sscanf(buf + 5, "%llu%n %llu%n", &lba, &pos, &n, &pos);
+	else
+		pos = -1;
+	if (pos < 0 || *skip_spaces(buf + 5 + pos)) {
+		pr_err("sop: could not parse scrub command \'%s\'\n", buf);
+		return -EINVAL;
+	}
+	ret = sop_scrub_start(h, lba, n);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(scrub, S_IRUGO|S_IWUSR, sop_show_scrub, sop_store_scrub);
+
+static ssize_t sop_show_scrub_rate(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+
+	return snprintf(buf, SOP_MAX_LINE_LEN, "%u\n", h->scrub_rate);
+}
+
+static ssize_t sop_store_scrub_rate(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	unsigned int rate;
+
+	if (sscanf(buf, "%u", &rate) < 1) {
+		pr_err("sop: could not set scrub_rate from \'%s\'\n", buf);
+		return -EINVAL;
+	}
+	h->scrub_rate = rate;
+	return count;
+}
+
+static DEVICE_ATTR(scrub_rate, S_IRUGO|S_IWUSR, sop_show_scrub_rate,
+		   sop_store_scrub_rate);
+
+static ssize_t sop_show_write_groups(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	ssize_t len = 0;
+	u32 i;
+
+	spin_lock(&h->wgroup_lock);
+	for (i = 0; i < h->nr_wgroups; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu %llu %u\n",
+				h->wgroup[i].lba, h->wgroup[i].nblocks,
+				h->wgroup[i].group);
+	spin_unlock(&h->wgroup_lock);
+	return len;
+}
+
+/* "lba nblocks group" adds a range, "clear" drops them all */
+static ssize_t sop_store_write_groups(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));
+	unsigned long long lba, n;
+	unsigned int group;
+	struct sop_write_group *wg;
+	int ret = count;
+
+	if (!strncmp(buf, "clear", 5)) {
+		spin_lock(&h->wgroup_lock);
+		h->nr_wgroups = 0;
+		spin_unlock(&h->wgroup_lock);
+		return count;
+	}
+	if (sscanf(buf, "%llu %llu %u", &lba, &n, &group) < 3 ||
+	    !n || group > 0x3f) {
+		pr_err("sop: could not parse write group \'%s\'\n", buf);
+		return -EINVAL;
+	}
+	if (!h->group_sup)
+		return -EOPNOTSUPP;
+
+	spin_lock(&h->wgroup_lock);
+	if (h->nr_wgroups == SOP_MAX_WRITE_GROUPS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	wg = &h->wgroup[h->nr_wgroups];
+	wg->lba = lba;
+	wg->nblocks = n;
+	wg->group = group;
+	/* The submit path looks without the lock, publish the entry last */
+	smp_wmb();
+	h->nr_wgroups++;
+out:
+	spin_unlock(&h->wgroup_lock);
+	return ret;
+}
+
+static DEVICE_ATTR(write_groups, S_IRUGO|S_IWUSR, sop_show_write_groups,
+		   sop_store_write_groups);
+
+/* Atomic write limits in bytes, 0 when there is no limit or no support */
+#define SOP_ATOMIC_ATTR(name, field)					\
+static ssize_t sop_show_##name(struct device *dev,			\
+			       struct device_attribute *attr, char *buf) \
+{									\
+	struct sop_device *h = pci_get_drvdata(to_pci_dev(dev));	\
+									\
+	return snprintf(buf, SOP_MAX_LINE_LEN, "%llu\n",		\
+			(u64) h->field * h->block_size);		\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, sop_show_##name, NULL)
+
+SOP_ATOMIC_ATTR(atomic_write_max_bytes, max_atomic_blocks);
+SOP_ATOMIC_ATTR(atomic_write_alignment_bytes, atomic_alignment);
+SOP_ATOMIC_ATTR(atomic_write_granularity_bytes, atomic_granularity);
+
+static struct attribute *sop_atomic_attrs[] = {
+	&dev_attr_atomic_write_max_bytes.attr,
+	&dev_attr_atomic_write_alignment_bytes.attr,
+	&dev_attr_atomic_write_granularity_bytes.attr,
+	NULL,
+};
+
+static struct attribute_group sop_atomic_attr_group = {
+	.attrs = sop_atomic_attrs,
+};
+
+static int sop_get_disk_params(struct sop_device *h)
+{
+	int ret;
+	dma_addr_t phy_addr;
+	void *vaddr;
+	int total_size;
+	u32 *data;
+	int retry_count;
+	struct sop_sync_cdb_req sio;
+	sector_t size_mask;
+	u32 max_xfer_len;
+	u32 max_prefetch_xdrdwr_xfer_len;
+
+	/* 0. Allocate memory */
+	total_size = 1024;
+	vaddr = pci_alloc_consistent(h->pdev, total_size, &phy_addr);
+	if (!vaddr)
+		return -ENOMEM;
+	data = (u32 *)vaddr;
+
+	/* Initialize the sync cdb struct */
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+
+	/* 0.1. Send Inquiry */
+	sio.data_len = 36;
+	sio.cdb[0] = INQUIRY;		/* Rest all remains 0 */
+	sio.cdb[4] = sio.data_len;
+	sio.cdblen = COMMAND_SIZE(INQUIRY);
+	sio.data_dir = DMA_FROM_DEVICE;
+	ret = send_sync_cdb(h, &sio, phy_addr);
+	if (ret != 0)
+		goto disk_param_err;
+	h->tpc = !!(((unsigned char *) vaddr)[5] & SOP_INQ_3PC);
+
+	/* 0.2. Get inquiry vpd page 0xb0 -- block limits */
+	sio.data_len = 64;
+	memset(vaddr, 0, sio.data_len);	/* don't parse stale INQUIRY data */
+	sio.cdb[0] = INQUIRY;		/* Rest all remains 0 */
+	sio.cdb[1] = 0x01; /* EVPD */
+	sio.cdb[2] = 0xb0; /* block limits page */
+	sio.cdb[4] = sio.data_len;
+	sio.cdblen = COMMAND_SIZE(INQUIRY);
+	sio.data_dir = DMA_FROM_DEVICE;
+	ret = send_sync_cdb(h, &sio, phy_addr);
+	if (ret == 0) {
+		unsigned char *buf = vaddr;
+		/* Bytes actually returned; older devices stop short of SBC-3 */
+		int page_end = min_t(int, ((buf[2] << 8) | buf[3]) + 4,
+				     sio.data_len);
+
+		h->max_caw_blocks = page_end >= 6 ? buf[5] : 0;
+		h->opt_xfer_gran = page_end >= 8 ? (buf[6] << 8) | buf[7] : 0;
+		max_xfer_len = page_end >= 12 ? extract_be32(buf, 8) : 0;
+		h->opt_xfer_len = page_end >= 16 ? extract_be32(buf, 12) : 0;
+		max_prefetch_xdrdwr_xfer_len = page_end >= 20 ?
+					extract_be32(buf, 16) : 0;
+		if (page_end >= 28) {
+			h->max_unmap_lba_count = extract_be32(buf, 20);
+			h->max_unmap_desc_count = extract_be32(buf, 24);
+		} else {
+			h->max_unmap_lba_count = 0;
+			h->max_unmap_desc_count = 0;
+		}
+		h->unmap_granularity = page_end >= 32 ?
+					extract_be32(buf, 28) : 0;
+		/* Alignment only counts with the UGAVALID bit set */
+		if (page_end >= 36 && (buf[32] & 0x80))
+			h->unmap_alignment = extract_be32(buf, 32) & 0x7fffffff;
+		else
+			h->unmap_alignment = 0;
+		h->max_write_same_blocks = page_end >= 44 ?
+					extract_be64(buf, 36) : 0;
+		/* The atomic limits came late (SBC-4), the page may stop short */
+		if (((buf[2] << 8) | buf[3]) >= SOP_VPD_B0_ATOMIC_LEN) {
+			h->max_atomic_blocks = extract_be32(buf, 44);
+			h->atomic_alignment = extract_be32(buf, 48);
+			h->atomic_granularity = extract_be32(buf, 52);
+		} else {
+			h->max_atomic_blocks = 0;
+			h->atomic_alignment = 0;
+			h->atomic_granularity = 0;
+		}
+	} else {
+		h->max_caw_blocks = 0;
+		h->opt_xfer_gran = 0;
+		max_xfer_len = BLK_SAFE_MAX_SECTORS;
+		h->opt_xfer_len = 0;
+		max_prefetch_xdrdwr_xfer_len = 0;
+		h->max_unmap_lba_count = 0;
+		h->max_unmap_desc_count = 0;
+		h->unmap_granularity = 0;
+		h->unmap_alignment = 0;
+		h->max_write_same_blocks = 0;
+		h->max_atomic_blocks = 0;
+		h->atomic_alignment = 0;
+		h->atomic_granularity = 0;
+	}
+
+	/* 0.3. Get inquiry vpd page 0xb2 -- logical block provisioning */
+	sio.data_len = 8;
+	sio.cdb[0] = INQUIRY;
+	sio.cdb[1] = 0x01; /* EVPD */
+	sio.cdb[2] = 0xb2; /* logical block provisioning page */
+	sio.cdb[4] = sio.data_len;
+	sio.cdblen = COMMAND_SIZE(INQUIRY);
+	sio.data_dir = DMA_FROM_DEVICE;
+	ret = send_sync_cdb(h, &sio, phy_addr);
+	if (ret == 0) {
+		unsigned char *buf = vaddr;
+
+		h->lbp_flags = buf[5];
+	} else
+		h->lbp_flags = 0;
+
+	/* 0.4. Get inquiry vpd page 0x86 -- extended inquiry data */
+	sio.data_len = 8;
+	sio.cdb[0] = INQUIRY;
+	sio.cdb[1] = 0x01; /* EVPD */
+	sio.cdb[2] = 0x86; /* extended inquiry data page */
+	sio.cdb[4] = sio.data_len;
+	sio.cdblen = COMMAND_SIZE(INQUIRY);
+	sio.data_dir = DMA_FROM_DEVICE;
+	ret = send_sync_cdb(h, &sio, phy_addr);
+	if (ret == 0) {
+		unsigned char *buf = vaddr;
+
+		h->group_sup = !!(buf[5] & SOP_EXT_INQ_GROUP_SUP);
+	} else
+		h->group_sup = 0;
+
+	if (max_xfer_len)
+		h->max_hw_sectors = max_xfer_len;
+	else
+		h->max_hw_sectors = BLK_SAFE_MAX_SECTORS;
+
+	retry_count = 0;
+sync_send_tur:
+	/* 1. send TUR */
+	memset(sio.cdb, 0, MAX_CDB_SIZE);
 	sio.cdb[0] = TEST_UNIT_READY;
 	sio.cdblen = COMMAND_SIZE(TEST_UNIT_READY);
 	sio.data_dir = DMA_NONE;
@@ -3966,19 +5941,42 @@ sync_send_tur:
 	}
 	/* Otherwise continue even with TUR failure, we just need capacity */
 
-	/* 2. Send Read Capacity */
+	/* 2. Send Read Capacity(16), needed past 2TB and for the geometry */
 	memset(sio.cdb, 0, MAX_CDB_SIZE);
-	sio.cdb[0] = READ_CAPACITY;		/* Rest all remains 0 */
-	sio.cdblen = COMMAND_SIZE(READ_CAPACITY);
-	sio.data_len = 2 * sizeof(u32);
+	sio.cdb[0] = SERVICE_ACTION_IN_16;
+	sio.cdb[1] = SAI_READ_CAPACITY_16;
+	sio.data_len = 32;
+	sio.cdb[13] = sio.data_len;
+	sio.cdblen = COMMAND_SIZE(SERVICE_ACTION_IN_16);
 	sio.data_dir = DMA_FROM_DEVICE;
 	ret = send_sync_cdb(h, &sio, phy_addr);
-	if (ret != 0)
-		goto disk_param_err;
+	if (ret == 0) {
+		unsigned char *buf = vaddr;
+
+		h->capacity = extract_be64(buf, 0) + 1;
+		h->block_size = extract_be32(buf, 8);
+		h->phys_block_exp = buf[13] & 0x0f;
+		h->lowest_aligned = ((buf[14] & 0x3f) << 8) | buf[15];
+		/* PROT_EN and P_TYPE */
+		h->prot_type = (buf[12] & 0x01) ? ((buf[12] >> 1) & 0x07) + 1 : 0;
+	} else {
+		/* 2.1. Fall back to Read Capacity(10) */
+		memset(sio.cdb, 0, MAX_CDB_SIZE);
+		sio.cdb[0] = READ_CAPACITY;	/* Rest all remains 0 */
+		sio.cdblen = COMMAND_SIZE(READ_CAPACITY);
+		sio.data_len = 2 * sizeof(u32);
+		sio.data_dir = DMA_FROM_DEVICE;
+		ret = send_sync_cdb(h, &sio, phy_addr);
+		if (ret != 0)
+			goto disk_param_err;
 
-	/* Process the Read Cap data */
-	h->capacity = be32_to_cpu(data[0]) + 1;
-	h->block_size = be32_to_cpu(data[1]);
+		/* Process the Read Cap data */
+		h->capacity = be32_to_cpu(data[0]) + 1;
+		h->block_size = be32_to_cpu(data[1]);
+		h->phys_block_exp = 0;
+		h->lowest_aligned = 0;
+		h->prot_type = 0;
+	}
 
 	/*
 	 * Make capacity at least multiple of PAGE_SIZE
@@ -3988,6 +5986,9 @@ sync_send_tur:
 	size_mask = (PAGE_SIZE / h->block_size) - 1;
 	h->capacity &= ~size_mask;
 
+	/* 3. Is there a volatile write cache to flush */
+	sop_read_cache_mode(h, vaddr, phy_addr);
+
 	pci_free_consistent(h->pdev, total_size, vaddr, phy_addr);
 	return 0;
 
@@ -3999,6 +6000,11 @@ disk_param_err:
 	/* Set Capacity to 0 and continue as degraded */
 	h->capacity = 0;
 	h->block_size = 0x200;
+	h->phys_block_exp = 0;
+	h->lowest_aligned = 0;
+	h->prot_type = 0;
+	h->wce = 1;
+	h->dpofua = 1;
 	return ret;
 }
 
@@ -4021,8 +6027,8 @@ static int sop_add_disk(struct sop_device *h)
 	queue_flag_set_unlocked(QUEUE_FLAG_NOMERGES, rq);
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rq);
 	blk_queue_make_request(rq, sop_make_request);
-	blk_queue_flush(rq, REQ_FLUSH | REQ_FUA);
-	blk_queue_flush_queueable(rq, false);
+	blk_queue_merge_bvec(rq, sop_merge_bvec);
+	blk_queue_flush_queueable(rq, true);
 	rq->queuedata = h;
 
 	disk = alloc_disk(SOP_MINORS);
@@ -4041,6 +6047,7 @@ static int sop_add_disk(struct sop_device *h)
 
 	/* Set driver specific parameters */
 	blk_queue_max_segments(rq, h->max_sgls);
+	h->pi_enabled = 1;	/* wherever the format has PI */
 
 	/* Set the rest of parmeters by reading from disk */
 	sop_revalidate(disk);
@@ -4049,6 +6056,20 @@ static int sop_add_disk(struct sop_device *h)
 		"Creating SOP drive '%s'- Capacity 0x%x sectors\n",
 		disk->disk_name, (int)(h->capacity));
 	add_disk(disk);
+	if (h->pi_enabled && sop_set_integrity(h, 1))
+		dev_warn(&h->pdev->dev, "Cannot register integrity profile\n");
+
+	if (device_create_file(&h->pdev->dev, &dev_attr_write_cache))
+		dev_warn(&h->pdev->dev, "Cannot create write_cache attribute\n");
+	if (sysfs_create_group(&h->pdev->dev.kobj, &sop_atomic_attr_group))
+		dev_warn(&h->pdev->dev, "Cannot create atomic_write attributes\n");
+	if (device_create_file(&h->pdev->dev, &dev_attr_integrity))
+		dev_warn(&h->pdev->dev, "Cannot create integrity attribute\n");
+	if (device_create_file(&h->pdev->dev, &dev_attr_scrub) ||
+	    device_create_file(&h->pdev->dev, &dev_attr_scrub_rate))
+		dev_warn(&h->pdev->dev, "Cannot create scrub attributes\n");
+	if (device_create_file(&h->pdev->dev, &dev_attr_write_groups))
+		dev_warn(&h->pdev->dev, "Cannot create write_groups attribute\n");
 
 	return 0;
 
@@ -4060,6 +6081,14 @@ static int sop_add_disk(struct sop_device *h)
 
 static void sop_remove_disk(struct sop_device *h)
 {
+	device_remove_file(&h->pdev->dev, &dev_attr_write_cache);
+	sysfs_remove_group(&h->pdev->dev.kobj, &sop_atomic_attr_group);
+	device_remove_file(&h->pdev->dev, &dev_attr_integrity);
+	device_remove_file(&h->pdev->dev, &dev_attr_scrub);
+	device_remove_file(&h->pdev->dev, &dev_attr_scrub_rate);
+	device_remove_file(&h->pdev->dev, &dev_attr_write_groups);
+	sop_scrub_stop(h);
+
 	/* First free the disk */
 	del_gendisk(h->disk);
 
@@ -4084,14 +6113,12 @@ static int sop_compat_ioctl(struct block_device *dev, fmode_t mode,
  * implementation of SG_IO.  This code is modelled on
  * block/scsi_ioctl.c: sg_io();
  */
-static int sop_sg_io(struct block_device *dev, fmode_t mode,
-			unsigned int cmd, void __user *argp)
+static int sop_sg_io(struct sop_device *h, fmode_t mode,
+			void __user *argp, struct sop_pt_file *f)
 {
-	struct sop_device *h;
 	sg_io_hdr_t *hp = NULL;
 	unsigned char cmnd[MAX_COMMAND_SIZE];
-	int timeout, data_dir, rc;
-	unsigned long ul_timeout;
+	int data_dir, rc;
 	u8 sop_data_dir;
 	int iov_count, len, read_only;
 	struct iovec *iov, *one_iovec = NULL;
@@ -4099,7 +6126,6 @@ static int sop_sg_io(struct block_device *dev, fmode_t mode,
 	unsigned long start_time;
 
 	rc = 0;
-	h = bdev_to_hba(dev);
 	if (!argp) {
 		if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
 			pr_err("SGIO Err: parameter is NULL\n");
@@ -4146,10 +6172,20 @@ static int sop_sg_io(struct block_device *dev, fmode_t mode,
 		goto out;
 	}
 	if (hp->flags & SG_FLAG_MMAP_IO) {
-		rc = -ENOSYS; /* FIXME we should support this. */
-		if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
-			pr_err("SGIO Err: MMAP_IO not supported\n");
-		goto out;
+		/* Only the passthrough node can be mmapped */
+		rc = -ENOSYS;
+		if (!f || !f->rsv_nmapped) {
+			if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
+				pr_err("SGIO Err: MMAP_IO without mmapped buffer\n");
+			goto out;
+		}
+		rc = -EINVAL;
+		if (hp->iovec_count || hp->dxfer_len > f->rsv_size) {
+			if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
+				pr_err("SGIO Err: MMAP_IO size %d, reserved %lu\n",
+					hp->dxfer_len, f->rsv_size);
+			goto out;
+		}
 	}
 	scdb = kmalloc(sizeof(*scdb), GFP_KERNEL);
 	if (!scdb) {
@@ -4159,10 +6195,9 @@ static int sop_sg_io(struct block_device *dev, fmode_t mode,
 		goto out;
 	}
 	memset(scdb, 0, sizeof(*scdb));
-	ul_timeout = hp->timeout/1000;
-	timeout = (ul_timeout < MAX_SOP_TIMEOUT) ? ul_timeout : MAX_SOP_TIMEOUT;
-	timeout = (timeout > 0) ? timeout : 1;
-	scdb->timeout = ul_timeout;
+	/* sg_io_hdr timeout is in msec already */
+	scdb->timeout_ms = clamp_t(u32, hp->timeout, SOP_TMO_TICK_MS,
+					SOP_TMO_MAX_MS);
 	if ((!hp->cmdp) || (hp->cmd_len < 6) || (hp->cmd_len > sizeof(cmnd))) {
 		rc = -EMSGSIZE;
 		if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
@@ -4232,7 +6267,11 @@ static int sop_sg_io(struct block_device *dev, fmode_t mode,
 	iov_count = hp->iovec_count;
 	len = hp->dxfer_len;
 	if (hp->dxfer_len > 0 && data_dir != DMA_NONE) {
-		if (iov_count) {
+		if (hp->flags & SG_FLAG_MMAP_IO) {
+			scdb->rsv_sgl = f->rsv_sgl;
+			scdb->rsv_nsegs = f->rsv_nmapped;
+			iov_count = 0;
+		} else if (iov_count) {
 			int size = sizeof(struct sg_iovec) * iov_count;
 
 			iov = memdup_user(hp->dxferp, size);
@@ -4272,7 +6311,13 @@ static int sop_sg_io(struct block_device *dev, fmode_t mode,
 
 	start_time = jiffies;
 	SOP_UPDATE_SGIO_COUNT(h);
+	if (scdb->rsv_sgl)
+		dma_sync_sg_for_device(&h->pdev->dev, f->rsv_sgl,
+				f->rsv_nchunks, DMA_BIDIRECTIONAL);
 	rc = send_sync_cdb(h, scdb, 0);
+	if (scdb->rsv_sgl)
+		dma_sync_sg_for_cpu(&h->pdev->dev, f->rsv_sgl,
+				f->rsv_nchunks, DMA_BIDIRECTIONAL);
 	hp->duration = jiffies_to_msecs(jiffies - start_time);
 	if (copy_to_user(argp, hp, sizeof(*hp))) {
 		rc = -EFAULT;
@@ -4287,53 +6332,1335 @@ out:
 	return rc;
 }
 
-static int sop_ioctl(struct block_device *dev, fmode_t mode,
-			unsigned int cmd, unsigned long arg)
+/* A third party copy CDB, len bytes of parameter data either way */
+static void sop_tpc_cdb(struct sop_sync_cdb_req *sio, u8 opcode, u8 sa,
+			u32 list_id, u32 len, int dir)
 {
-	__attribute__((unused)) struct sop_device *h = bdev_to_hba(dev);
-	void __user *argp = (void __user *)arg;
+	int id_off = (opcode == SOP_TPC_IN) ? 2 : 6;
+	int i;
 
-	switch (cmd) {
-#if 0
-	case SG_GET_VERSION_NUM:
-	case SG_SET_TIMEOUT:
-	case SG_GET_TIMEOUT:
-	case SG_GET_RESERVED_SIZE:
-	case SG_SET_RESERVED_SIZE:
-	case SG_EMULATED_HOST:
-	case SCSI_IOCTL_SEND_COMMAND:
-#endif
-	case SG_IO:
-		return sop_sg_io(dev, mode, cmd, argp);
-	default:
-		return -ENOTTY;
+	memset(sio, 0, sizeof(*sio));
+	sio->timeout_ms = SOP_COPY_TIMEOUT * MSEC_PER_SEC;
+	sio->cdb[0] = opcode;
+	sio->cdb[1] = sa;
+	for (i = 0; i < 4; i++) {
+		sio->cdb[id_off + i] = SOP_GET_BYTE(list_id, 3 - i);
+		sio->cdb[10 + i] = SOP_GET_BYTE(len, 3 - i);
 	}
+	sio->cdblen = 16;
+	sio->data_len = len;
+	sio->data_dir = dir;
 }
 
-static int sop_add_timeout(struct queue_info *q, uint timeout)
+/* An ILLEGAL REQUEST means no token copies on this device after all */
+static int sop_tpc_send(struct sop_device *h, struct sop_sync_cdb_req *sio,
+			dma_addr_t phy_addr)
 {
-	int tmo_slot;
-
-	tmo_slot = ((atomic_read(&q->tmo.cur_slot) + timeout) %
-				MAX_SOP_TIMEOUT);
-	atomic_inc(&q->tmo.time_slot[tmo_slot]);
-	return tmo_slot;
+	if (!send_sync_cdb(h, sio, phy_addr))
+		return 0;
+	if (sio->scsi_status == SAM_STAT_CHECK_CONDITION &&
+	    (sio->sense_key & 0x0f) == ILLEGAL_REQUEST) {
+		dev_warn(&h->pdev->dev,
+			"copy offload refused (ASC/ASCQ 0x%04x), copying via host\n",
+			sio->sense_asc_ascq);
+		h->tpc = 0;
+		return -EOPNOTSUPP;
+	}
+	return -EIO;
 }
 
-static void sop_rem_timeout(struct queue_info *q, uint tmo_slot)
+static void sop_put_range(unsigned char *buf, int len_off, u64 lba, u32 n)
 {
-	/* Check for invalid slot - if it has already timed out */
-	if (tmo_slot >= MAX_SOP_TIMEOUT)
-		return;
+	struct sop_unmap_blk_desc *desc;
 
-	if (atomic_read(&q->tmo.time_slot[tmo_slot]) == 0) {
-		dev_err(&q->h->pdev->dev,
-			"Q[%d] TM slot[%d] count is 0, cur_slot=%d\n",
-			qinfo_to_qid(q), tmo_slot,
-			atomic_read(&q->tmo.cur_slot));
+	/* Same block device range descriptor as UNMAP */
+	desc = (struct sop_unmap_blk_desc *) &buf[len_off + 2];
+	buf[len_off] = 0;
+	buf[len_off + 1] = sizeof(*desc);
+	desc->lba = cpu_to_be64(lba);
+	desc->nblocks = cpu_to_be32(n);
+	desc->reserved = 0;
+}
+
+static int sop_populate_token(struct sop_device *h, unsigned char *buf,
+			      dma_addr_t phy_addr, u32 list_id, u64 lba, u32 n)
+{
+	struct sop_sync_cdb_req sio;
+	int len = 16 + sizeof(struct sop_unmap_blk_desc);
+
+	/* Inactivity timeout and ROD type 0 leave it to the device */
+	memset(buf, 0, len);
+	buf[0] = SOP_GET_BYTE(len - 2, 1);
+	buf[1] = SOP_GET_BYTE(len - 2, 0);
+	sop_put_range(buf, 14, lba, n);
+
+	sop_tpc_cdb(&sio, SOP_TPC_OUT, SOP_SA_POPULATE_TOKEN, list_id, len,
+			DMA_TO_DEVICE);
+	return sop_tpc_send(h, &sio, phy_addr);
+}
+
+/*
+ * Fetch the token list_id populated and move it to where WRITE USING
+ * TOKEN wants it in buf.  *n is cut down to what the token covers.
+ */
+static int sop_receive_rod_token(struct sop_device *h, unsigned char *buf,
+				 dma_addr_t phy_addr, u32 list_id, u32 *n)
+{
+	struct sop_sync_cdb_req sio;
+	int off, ret;
+	u64 count;
+
+	sop_tpc_cdb(&sio, SOP_TPC_IN, SOP_SA_RECEIVE_ROD_TOKEN_INFO, list_id,
+			SOP_COPY_BUF_LEN, DMA_FROM_DEVICE);
+	ret = sop_tpc_send(h, &sio, phy_addr);
+	if (ret)
+		return ret;
+
+	switch (buf[5] & 0x7f) {
+	case 0x01:	/* completed without errors */
+		break;
+	case 0x03:	/* completed with partial ROD token usage */
+	case 0x04:	/* completed with residual data */
+		/* Transfer count in logical blocks */
+		if (buf[15] != 0xf1)
+			return -EIO;
+		count = extract_be64(buf, 16);
+		if (count < *n)
+			*n = count;
+		break;
+	default:
+		return -EIO;
+	}
+
+	off = 32 + buf[13];
+	if (*n == 0 || off + 6 + SOP_ROD_TOKEN_LEN > SOP_COPY_BUF_LEN ||
+	    extract_be32(buf, off) < 2 + SOP_ROD_TOKEN_LEN)
+		return -EIO;
+	memmove(&buf[SOP_WUT_TOKEN_OFF], &buf[off + 6], SOP_ROD_TOKEN_LEN);
+	return 0;
+}
+
+/* buf already holds the token from sop_receive_rod_token() */
+static int sop_write_using_token(struct sop_device *h, unsigned char *buf,
+				 dma_addr_t phy_addr, u32 list_id, u64 lba,
+				 u32 n)
+{
+	struct sop_sync_cdb_req sio;
+	int len = SOP_WUT_DESC_OFF + sizeof(struct sop_unmap_blk_desc);
+
+	memset(buf, 0, SOP_WUT_TOKEN_OFF);
+	memset(&buf[SOP_WUT_TOKEN_OFF + SOP_ROD_TOKEN_LEN], 0,
+		SOP_WUT_DESC_OFF - 2 - SOP_WUT_TOKEN_OFF - SOP_ROD_TOKEN_LEN);
+	buf[0] = SOP_GET_BYTE(len - 2, 1);
+	buf[1] = SOP_GET_BYTE(len - 2, 0);
+	buf[2] = SOP_WUT_DEL_TKN;	/* single use, let the device drop it */
+	sop_put_range(buf, SOP_WUT_DESC_OFF - 2, lba, n);
+
+	sop_tpc_cdb(&sio, SOP_TPC_OUT, SOP_SA_WRITE_USING_TOKEN, list_id, len,
+			DMA_TO_DEVICE);
+	return sop_tpc_send(h, &sio, phy_addr);
+}
+
+/*
+ * Copy with POPULATE TOKEN / WRITE USING TOKEN a token's worth at a
+ * time.  All in logical blocks; *done counts what got copied, even
+ * when this fails.
+ */
+static int sop_copy_offload(struct sop_device *h, u64 src, u64 dst, u64 nr,
+			    u64 *done)
+{
+	unsigned char *buf;
+	dma_addr_t phy_addr;
+	u32 list_id, n;
+	int ret = 0;
+
+	buf = pci_alloc_consistent(h->pdev, SOP_COPY_BUF_LEN, &phy_addr);
+	if (!buf)
+		return -ENOMEM;
+
+	while (*done < nr) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		n = min_t(u64, nr - *done, SOP_COPY_CHUNK_BLOCKS);
+		list_id = atomic_inc_return(&h->copy_list_id);
+		ret = sop_populate_token(h, buf, phy_addr, list_id,
+					src + *done, n);
+		if (!ret)
+			ret = sop_receive_rod_token(h, buf, phy_addr, list_id,
+					&n);
+		if (!ret)
+			ret = sop_write_using_token(h, buf, phy_addr, list_id,
+					dst + *done, n);
+		if (ret)
+			break;
+		*done += n;
+	}
+
+	pci_free_consistent(h->pdev, SOP_COPY_BUF_LEN, buf, phy_addr);
+	return ret;
+}
+
+static int sop_rw16(struct sop_device *h, u8 opcode, u64 lba, u32 n,
+		    dma_addr_t phy_addr)
+{
+	struct sop_sync_cdb_req sio;
+	int i;
+
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.cdb[0] = opcode;
+	for (i = 0; i < 8; i++)
+		sio.cdb[2 + i] = SOP_GET_BYTE(lba, 7 - i);
+	for (i = 0; i < 4; i++)
+		sio.cdb[10 + i] = SOP_GET_BYTE(n, 3 - i);
+	sio.cdblen = COMMAND_SIZE(opcode);
+	sio.data_len = n * h->block_size;
+	sio.data_dir = (opcode == READ_16) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	return send_sync_cdb(h, &sio, phy_addr) ? -EIO : 0;
+}
+
+/* The fallback: through a bounce buffer, one command each way, in blocks */
+static int sop_copy_via_host(struct sop_device *h, u64 src, u64 dst, u64 nr)
+{
+	unsigned char *buf;
+	dma_addr_t phy_addr;
+	u32 len, per, n;
+	u64 done;
+	int ret = 0;
+
+	len = min_t(u32, SOP_COPY_BOUNCE_BYTES,
+			h->max_hw_sectors << 9);
+	while (!(buf = pci_alloc_consistent(h->pdev, len, &phy_addr))) {
+		if (len <= max_t(u32, PAGE_SIZE, h->block_size))
+			return -ENOMEM;
+		len >>= 1;
+	}
+	per = len / h->block_size;
+
+	for (done = 0; done < nr && !ret; done += n) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		n = min_t(u64, nr - done, per);
+		ret = sop_rw16(h, READ_16, src + done, n, phy_addr);
+		if (!ret)
+			ret = sop_rw16(h, WRITE_16, dst + done, n, phy_addr);
+	}
+
+	pci_free_consistent(h->pdev, len, buf, phy_addr);
+	return ret;
+}
+
+/*
+ * The ioctls take 512-byte sectors relative to the partition, the
+ * device wants whole logical blocks.
+ */
+static int sop_sectors_to_lba(struct sop_device *h, struct block_device *bdev,
+			      u64 sector, u64 nr_sectors, u64 *lba, u64 *nblocks)
+{
+	int shift = ilog2(h->block_size) - 9;
+	u64 mask = (1ULL << shift) - 1;
+
+	sector += get_start_sect(bdev);
+	if ((sector & mask) || (nr_sectors & mask))
+		return -EINVAL;
+	*lba = sector >> shift;
+	*nblocks = nr_sectors >> shift;
+	return 0;
+}
+
+static int sop_ioctl_copy(struct sop_device *h, struct block_device *bdev,
+			  fmode_t mode, void __user *argp)
+{
+	struct sop_copy_range cr;
+	u64 size = i_size_read(bdev->bd_inode) >> 9;
+	u64 src, dst, nr, unused;
+	u64 done = 0;
+	int ret = -EOPNOTSUPP;
+
+	if (!(mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&cr, argp, sizeof(cr)))
+		return -EFAULT;
+	if (!cr.nr_sectors || cr.nr_sectors > size ||
+	    cr.src_sector > size - cr.nr_sectors ||
+	    cr.dst_sector > size - cr.nr_sectors)
+		return -EINVAL;
+	/* Neither way of copying promises anything for overlapping ranges */
+	if (cr.src_sector < cr.dst_sector + cr.nr_sectors &&
+	    cr.dst_sector < cr.src_sector + cr.nr_sectors)
+		return -EINVAL;
+	if (sop_sectors_to_lba(h, bdev, cr.src_sector, cr.nr_sectors,
+				&src, &nr) ||
+	    sop_sectors_to_lba(h, bdev, cr.dst_sector, 0, &dst, &unused))
+		return -EINVAL;
+
+	/* The device copies what is on the media, get the source there */
+	ret = filemap_write_and_wait_range(bdev->bd_inode->i_mapping,
+			cr.src_sector << 9,
+			((cr.src_sector + cr.nr_sectors) << 9) - 1);
+	if (ret)
+		return ret;
+
+	ret = -EOPNOTSUPP;
+	if (h->tpc)
+		ret = sop_copy_offload(h, src, dst, nr, &done);
+	cr.offloaded = (done == nr);
+	if (ret == -EOPNOTSUPP && !(cr.flags & SOP_COPY_NO_FALLBACK))
+		ret = sop_copy_via_host(h, src + done, dst + done, nr - done);
+
+	/* What is cached of the destination is stale now */
+	truncate_inode_pages_range(bdev->bd_inode->i_mapping,
+			cr.dst_sector << 9,
+			((cr.dst_sector + cr.nr_sectors) << 9) - 1);
+
+	if (!ret && copy_to_user(argp, &cr, sizeof(cr)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/*
+ * Verify and write data go out back to back as one data-out transfer,
+ * each half straight from its user buffer, so one IU does the whole
+ * test-and-set.
+ */
+static int sop_ioctl_compare_write(struct sop_device *h,
+				   struct block_device *bdev, fmode_t mode,
+				   void __user *argp)
+{
+	struct sop_compare_write cw;
+	struct sop_sync_cdb_req sio;
+	struct iovec iov[2];
+	u64 size = i_size_read(bdev->bd_inode) >> 9;
+	u64 lba, nblocks;
+	u32 len;
+	int i, nsegs, ret;
+
+	if (!(mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&cw, argp, sizeof(cw)))
+		return -EFAULT;
+	if (!h->max_caw_blocks)
+		return -EOPNOTSUPP;
+	if (!cw.nr_sectors || cw.sector > size ||
+	    cw.nr_sectors > size - cw.sector)
+		return -EINVAL;
+	if (sop_sectors_to_lba(h, bdev, cw.sector, cw.nr_sectors,
+				&lba, &nblocks) ||
+	    nblocks > h->max_caw_blocks)
+		return -EINVAL;
+
+	len = cw.nr_sectors << 9;
+	iov[0].iov_base = (void __user *) (unsigned long) cw.compare;
+	iov[1].iov_base = (void __user *) (unsigned long) cw.write;
+	nsegs = 0;
+	for (i = 0; i < 2; i++) {
+		iov[i].iov_len = len;
+		nsegs += DIV_ROUND_UP(offset_in_page(iov[i].iov_base) + len,
+					PAGE_SIZE);
+	}
+	/* No partial issue here, both halves have to fit in one command */
+	if (nsegs >= h->max_sgls)
+		return -EINVAL;
+
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.cdb[0] = COMPARE_AND_WRITE;
+	if (cw.flags & SOP_CAW_FUA)
+		sio.cdb[1] = SOP_CAW_FUA_BIT;
+	for (i = 0; i < 8; i++)
+		sio.cdb[2 + i] = SOP_GET_BYTE(lba, 7 - i);
+	sio.cdb[13] = nblocks;
+	sio.cdblen = COMMAND_SIZE(COMPARE_AND_WRITE);
+	sio.iov = iov;
+	sio.iov_count = 2;
+	sio.data_len = 2 * len;
+	sio.data_dir = DMA_TO_DEVICE;
+	sio.lock_op = 1;
+
+	ret = send_sync_cdb(h, &sio, 0);
+	cw.miscompare = (sio.scsi_status == SAM_STAT_CHECK_CONDITION &&
+			 (sio.sense_key & 0x0f) == MISCOMPARE);
+	if (ret && !cw.miscompare)
+		return ret < 0 ? ret : -EIO;
+
+	if (!cw.miscompare)
+		truncate_inode_pages_range(bdev->bd_inode->i_mapping,
+				cw.sector << 9,
+				((cw.sector + cw.nr_sectors) << 9) - 1);
+	if (copy_to_user(argp, &cw, sizeof(cw)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * One WRITE ATOMIC(16) straight from the user buffer.  An ioctl of its
+ * own because nothing below could split or merge it on the way.
+ */
+static int sop_ioctl_atomic_write(struct sop_device *h,
+				  struct block_device *bdev, fmode_t mode,
+				  void __user *argp)
+{
+	struct sop_atomic_write aw;
+	struct sop_sync_cdb_req sio;
+	struct iovec iov;
+	u64 size = i_size_read(bdev->bd_inode) >> 9;
+	u64 lba, nblocks;
+	int i, ret;
+
+	if (!(mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&aw, argp, sizeof(aw)))
+		return -EFAULT;
+	if (!h->max_atomic_blocks)
+		return -EOPNOTSUPP;
+
+	if (!aw.nr_sectors || aw.sector > size ||
+	    aw.nr_sectors > size - aw.sector)
+		return -EINVAL;
+	/* The device limits are all in logical blocks */
+	if (sop_sectors_to_lba(h, bdev, aw.sector, aw.nr_sectors,
+				&lba, &nblocks) ||
+	    nblocks > h->max_atomic_blocks || nblocks > 0xffff)
+		return -EINVAL;
+	if (h->atomic_granularity && (u32) nblocks % h->atomic_granularity)
+		return -EINVAL;
+	if (h->atomic_alignment) {
+		u64 start = lba;
+
+		if (do_div(start, h->atomic_alignment))
+			return -EINVAL;
+	}
+
+	iov.iov_base = (void __user *) (unsigned long) aw.buf;
+	iov.iov_len = aw.nr_sectors << 9;
+	/* No partial issue, the whole write has to go in one command */
+	if (DIV_ROUND_UP(offset_in_page(iov.iov_base) + iov.iov_len,
+			 PAGE_SIZE) >= h->max_sgls)
+		return -EINVAL;
+
+	memset(&sio, 0, sizeof(sio));
+	sio.timeout_ms = DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	sio.cdb[0] = SOP_WRITE_ATOMIC_16;
+	if (aw.flags & SOP_ATOMIC_FUA)
+		sio.cdb[1] = SOP_FUA;
+	for (i = 0; i < 8; i++)
+		sio.cdb[2 + i] = SOP_GET_BYTE(lba, 7 - i);
+	/* ATOMIC BOUNDARY 0: the whole transfer is one atomic unit */
+	sio.cdb[12] = SOP_GET_BYTE(nblocks, 1);
+	sio.cdb[13] = SOP_GET_BYTE(nblocks, 0);
+	sio.cdblen = 16;
+	sio.iov = &iov;
+	sio.iov_count = 1;
+	sio.data_len = iov.iov_len;
+	sio.data_dir = DMA_TO_DEVICE;
+
+	ret = send_sync_cdb(h, &sio, 0);
+	if (ret)
+		return ret < 0 ? ret : -EIO;
+
+	truncate_inode_pages_range(bdev->bd_inode->i_mapping,
+			aw.sector << 9,
+			((aw.sector + aw.nr_sectors) << 9) - 1);
+	return 0;
+}
+
+static int sop_ioctl(struct block_device *dev, fmode_t mode,
+			unsigned int cmd, unsigned long arg)
+{
+	struct sop_device *h = bdev_to_hba(dev);
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+#if 0
+	case SG_GET_VERSION_NUM:
+	case SG_SET_TIMEOUT:
+	case SG_GET_TIMEOUT:
+	case SG_GET_RESERVED_SIZE:
+	case SG_SET_RESERVED_SIZE:
+	case SG_EMULATED_HOST:
+	case SCSI_IOCTL_SEND_COMMAND:
+#endif
+	case SG_IO:
+		return sop_sg_io(h, mode, argp, NULL);
+	case SOP_IOC_COPY:
+		return sop_ioctl_copy(h, dev, mode, argp);
+	case SOP_IOC_COMPARE_WRITE:
+		return sop_ioctl_compare_write(h, dev, mode, argp);
+	case SOP_IOC_ATOMIC_WRITE:
+		return sop_ioctl_atomic_write(h, dev, mode, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Translate the response of a passthrough command, in interrupt context */
+static void sop_pt_fill_cpl(struct sop_request *r, struct sop_pt_cpl *cpl)
+{
+	struct sop_cmd_response *scr;
+	u16 sense_data_len;
+	u32 data_xferred;
+
+	switch (r->response[0]) {
+	case SOP_RESPONSE_CMD_SUCCESS_IU_TYPE:
+		break;
+
+	case SOP_RESPONSE_CMD_RESPONSE_IU_TYPE:
+		scr = (struct sop_cmd_response *) r->response;
+		cpl->status = scr->status;
+		sense_data_len = min_t(u16, le16_to_cpu(scr->sense_data_len),
+					SOP_PT_SENSE_LEN);
+		memcpy(cpl->sense, scr->sense, sense_data_len);
+		cpl->sense_len = sense_data_len;
+		if (scr->data_in_xfer_result)
+			data_xferred = le32_to_cpu(scr->data_in_xferred);
+		else
+			data_xferred = le32_to_cpu(scr->data_out_xferred);
+		cpl->resid = r->xfer_size - data_xferred;
+		break;
+
+	case SOP_RESPONSE_TIMEOUT_CMD_FAIL_IU_TYPE:
+		cpl->result = -ETIMEDOUT;
+		cpl->resid = r->xfer_size;
+		break;
+
+	case SOP_RESPONSE_INTERNAL_CMD_FAIL_IU_TYPE:
+	default:
+		cpl->result = -EIO;
+		cpl->resid = r->xfer_size;
+		break;
+	}
+}
+
+/* Called by the owner of the outbound queue, or on timeout/reset */
+static void sop_complete_pt(struct sop_device *h, struct queue_info *q,
+			    struct sop_request *r)
+{
+	struct sop_pt_req *pr = r->pt;
+	struct sop_pt_file *f = pr->f;
+	unsigned long flags;
+	int i;
+
+	sop_rem_timeout(q, r);
+	if (pr->rb) {
+		for (i = 0; i < pr->nsegs; i++)
+			dma_sync_single_for_cpu(&h->pdev->dev,
+				sg_dma_address(&pr->sgl[i]),
+				sg_dma_len(&pr->sgl[i]), pr->dma_dir);
+		atomic_dec(&pr->rb->users);
+	} else if (pr->dma_dir != DMA_NONE) {
+		dma_unmap_sg(&h->pdev->dev, pr->sgl, pr->nsegs, pr->dma_dir);
+		for (i = 0; i < pr->nsegs; i++)
+			put_page(sg_page(&pr->sgl[i]));
+	}
+	sop_pt_fill_cpl(r, &pr->cpl);
+	free_request(h, &h->io_req[q->numa_node], r->request_id);
+
+	sop_mgmt_wake(h, q);
+
+	spin_lock_irqsave(&f->lock, flags);
+	list_add_tail(&pr->entry, &f->done);
+	f->pending--;
+	spin_unlock_irqrestore(&f->lock, flags);
+	/* Not only readers: release waits uninterruptibly for pending */
+	wake_up(&f->wait);
+}
+
+/* Point pr at the part of a registered buffer the command refers to */
+static int sop_pt_use_regbuf(struct sop_pt_file *f, struct sop_pt_req *pr,
+			     struct sop_pt_cmd *cmd)
+{
+	struct sop_device *h = f->h;
+	struct sop_pt_regbuf *rb;
+	int i, nsegs;
+
+	if (cmd->buf_index >= SOP_PT_MAX_REGBUF)
+		return -EINVAL;
+	rb = &f->regbuf[cmd->buf_index];
+
+	spin_lock_irq(&f->lock);
+	if (!rb->nmapped) {
+		spin_unlock_irq(&f->lock);
+		return -EINVAL;
+	}
+	atomic_inc(&rb->users);
+	spin_unlock_irq(&f->lock);
+
+	nsegs = -EINVAL;
+	if (cmd->buf < rb->len && cmd->len <= rb->len - cmd->buf)
+		nsegs = sop_fill_mapped_sgl(pr->sgl, h->max_sgls, rb->sgl,
+					rb->nmapped, cmd->buf, cmd->len);
+	if (nsegs <= 0) {
+		atomic_dec(&rb->users);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nsegs; i++)
+		dma_sync_single_for_device(&h->pdev->dev,
+			sg_dma_address(&pr->sgl[i]), sg_dma_len(&pr->sgl[i]),
+			pr->dma_dir);
+	pr->rb = rb;
+	pr->nsegs = nsegs;
+	return 0;
+}
+
+/*
+ * Post one passthrough command on qinfo without ringing the doorbell,
+ * the caller does that once for the whole batch.
+ */
+static int sop_pt_submit(struct sop_pt_file *f, struct queue_info *qinfo,
+			 struct sop_pt_cmd *cmd)
+{
+	struct sop_device *h = f->h;
+	struct sop_sync_cdb_req sio;
+	struct sop_limited_cmd_iu *r;
+	struct sop_request *ser;
+	struct sop_pt_req *pr;
+	struct iovec iov;
+	u16 request_id;
+	int dma_dir, nsegs = 0;
+	u32 timeout_ms;
+	int rc;
+
+	if (cmd->cdb_len < 6 || cmd->cdb_len > sizeof(cmd->cdb))
+		return -EMSGSIZE;
+	if (cmd->len > h->max_hw_sectors * 512)
+		return -EINVAL;
+
+	switch (cmd->dir) {
+	case SOP_PT_DIR_NONE:
+		dma_dir = DMA_NONE;
+		break;
+	case SOP_PT_DIR_FROM_DEV:
+		dma_dir = DMA_FROM_DEVICE;
+		break;
+	case SOP_PT_DIR_TO_DEV:
+		dma_dir = DMA_TO_DEVICE;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (!cmd->len)
+		dma_dir = DMA_NONE;
+
+	if (SOP_DEVICE_REM(h))
+		return -EIO;
+	if (SOP_DEVICE_BUSY(h))
+		return -EAGAIN;
+
+	spin_lock_irq(&f->lock);
+	if (list_empty(&f->free)) {
+		spin_unlock_irq(&f->lock);
+		return -EBUSY;
+	}
+	pr = list_first_entry(&f->free, struct sop_pt_req, entry);
+	list_del(&pr->entry);
+	spin_unlock_irq(&f->lock);
+
+	memset(&pr->cpl, 0, sizeof(pr->cpl));
+	pr->cpl.tag = cmd->tag;
+	pr->dma_dir = dma_dir;
+	pr->nsegs = 0;
+	pr->rb = NULL;
+	if (dma_dir != DMA_NONE && (cmd->flags & SOP_PT_FLAG_REG_BUF)) {
+		rc = sop_pt_use_regbuf(f, pr, cmd);
+		if (rc)
+			goto pt_map_fail;
+		nsegs = pr->nsegs;
+	} else if (dma_dir != DMA_NONE) {
+		memset(&sio, 0, sizeof(sio));
+		iov.iov_base = (void __user *) (unsigned long) cmd->buf;
+		iov.iov_len = cmd->len;
+		sio.iov = &iov;
+		sio.iov_count = 1;
+		sio.data_dir = dma_dir;
+		rc = sop_map_user_iov(&sio, pr->sgl, h->max_sgls,
+					pr->page_map);
+		if (rc <= 0 || sio.iovec_idx != 1) {
+			if (rc > 0) {
+				pr->nsegs = rc;
+				rc = -EINVAL;
+				goto pt_put_pages;
+			}
+			rc = rc ? rc : -EINVAL;
+			goto pt_map_fail;
+		}
+		pr->nsegs = rc;
+		nsegs = dma_map_sg(&h->pdev->dev, pr->sgl, pr->nsegs, dma_dir);
+		if (nsegs <= 0) {
+			rc = -EIO;
+			goto pt_put_pages;
+		}
+	}
+
+	timeout_ms = cmd->timeout_ms ? cmd->timeout_ms :
+				DEF_IO_TIMEOUT * MSEC_PER_SEC;
+	timeout_ms = clamp_t(u32, timeout_ms, SOP_TMO_TICK_MS, SOP_TMO_MAX_MS);
+	memset(cmd->cdb + cmd->cdb_len, 0, sizeof(cmd->cdb) - cmd->cdb_len);
+
+	spin_lock_irq(&qinfo->iq->qlock);
+	rc = -EBUSY;
+	request_id = alloc_request(h, &h->io_req[qinfo->numa_node]);
+	if (request_id == (u16) -EBUSY)
+		goto pt_req_id_fail;
+	r = pqi_alloc_elements(qinfo->iq, 1);
+	if (IS_ERR(r))
+		goto pt_alloc_elem_fail;
+
+	ser = &h->io_req[qinfo->numa_node].request[request_id];
+	ser->start_time = jiffies;
+	ser->qid = qinfo_to_qid(qinfo);
+	ser->request_id = request_id;
+	ser->bio = NULL;
+	ser->waiting = NULL;
+	ser->pt = pr;
+	ser->num_sg = 0;
+	ser->xfer_size = 0;
+	sop_scatter_gather(h, qinfo, nsegs, r, pr->sgl, &ser->xfer_size);
+	fill_send_cdb_request(r, qinfo->oq->queue_id, request_id, cmd->cdb,
+				sizeof(cmd->cdb), ser->xfer_size, dma_dir);
+
+	spin_lock(&f->lock);
+	f->pending++;
+	spin_unlock(&f->lock);
+
+	atomic_inc(&qinfo->cur_qdepth);
+	atomic_inc(&h->cmd_pending);
+	sop_add_timeout(qinfo, ser, timeout_ms);
+	ser->retry_count = 0;
+	spin_unlock_irq(&qinfo->iq->qlock);
+	SOP_UPDATE_SGIO_COUNT(h);
+	return 0;
+
+pt_alloc_elem_fail:
+	free_request(h, &h->io_req[qinfo->numa_node], request_id);
+pt_req_id_fail:
+	spin_unlock_irq(&qinfo->iq->qlock);
+	if (pr->rb) {
+		atomic_dec(&pr->rb->users);
+		goto pt_map_fail;
+	}
+	if (nsegs)
+		dma_unmap_sg(&h->pdev->dev, pr->sgl, pr->nsegs, dma_dir);
+pt_put_pages:
+	for (nsegs = 0; nsegs < pr->nsegs; nsegs++)
+		put_page(sg_page(&pr->sgl[nsegs]));
+pt_map_fail:
+	spin_lock_irq(&f->lock);
+	list_add(&pr->entry, &f->free);
+	spin_unlock_irq(&f->lock);
+	return rc;
+}
+
+/* Keep remove from tearing the device down under a file operation */
+static int sop_pt_enter(struct sop_pt_file *f)
+{
+	down_read(&f->h->pt_rwsem);
+	if (!f->dead)
+		return 0;
+	up_read(&f->h->pt_rwsem);
+	return -ENODEV;
+}
+
+static void sop_pt_exit(struct sop_pt_file *f)
+{
+	up_read(&f->h->pt_rwsem);
+}
+
+static ssize_t sop_pt_write(struct file *filp, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct sop_pt_file *f = filp->private_data;
+	struct sop_device *h = f->h;
+	struct queue_info *qinfo;
+	struct sop_pt_cmd cmd;
+	size_t done = 0;
+	int posted = 0;
+	int rc = 0;
+	int cpu;
+
+	if (!count || count % sizeof(cmd))
+		return -EINVAL;
+	if (sop_pt_enter(f))
+		return -ENODEV;
+
+	/* The whole batch goes on the queue of the submitting CPU */
+	cpu = get_cpu();
+	qinfo = &h->qinfo[find_sop_queue(h, cpu)];
+	put_cpu();
+
+	while (done < count) {
+		if (copy_from_user(&cmd, ubuf + done, sizeof(cmd))) {
+			rc = -EFAULT;
+			break;
+		}
+		rc = sop_pt_submit(f, qinfo, &cmd);
+		if (rc)
+			break;
+		done += sizeof(cmd);
+		posted++;
+	}
+
+	if (posted) {
+		spin_lock_irq(&qinfo->iq->qlock);
+		writew(qinfo->iq->unposted_index, qinfo->iq->index.to_dev.pi);
+		spin_unlock_irq(&qinfo->iq->qlock);
+	}
+	sop_pt_exit(f);
+
+	return done ? done : rc;
+}
+
+static int sop_pt_has_done(struct sop_pt_file *f)
+{
+	int ret;
+
+	spin_lock_irq(&f->lock);
+	ret = !list_empty(&f->done) || f->dead;
+	spin_unlock_irq(&f->lock);
+	return ret;
+}
+
+static ssize_t sop_pt_read(struct file *filp, char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	struct sop_pt_file *f = filp->private_data;
+	struct sop_pt_req *pr;
+	size_t done = 0;
+	int rc;
+
+	if (count < sizeof(pr->cpl))
+		return -EINVAL;
+
+	if (!(filp->f_flags & O_NONBLOCK)) {
+		rc = wait_event_interruptible(f->wait, sop_pt_has_done(f));
+		if (rc)
+			return rc;
+	}
+
+	/* Reap as many completions as fit */
+	while (done + sizeof(pr->cpl) <= count) {
+		spin_lock_irq(&f->lock);
+		if (list_empty(&f->done)) {
+			spin_unlock_irq(&f->lock);
+			break;
+		}
+		pr = list_first_entry(&f->done, struct sop_pt_req, entry);
+		list_del(&pr->entry);
+		spin_unlock_irq(&f->lock);
+
+		rc = copy_to_user(ubuf + done, &pr->cpl, sizeof(pr->cpl));
+
+		spin_lock_irq(&f->lock);
+		if (rc)
+			list_add(&pr->entry, &f->done);
+		else
+			list_add_tail(&pr->entry, &f->free);
+		spin_unlock_irq(&f->lock);
+		if (rc)
+			return done ? done : -EFAULT;
+		done += sizeof(pr->cpl);
+	}
+
+	if (!done && f->dead)
+		return -ENODEV;
+	return done ? done : -EAGAIN;
+}
+
+static unsigned int sop_pt_poll(struct file *filp, poll_table *wait)
+{
+	struct sop_pt_file *f = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &f->wait, wait);
+
+	spin_lock_irq(&f->lock);
+	if (!list_empty(&f->done))
+		mask |= POLLIN | POLLRDNORM;
+	if (!list_empty(&f->free))
+		mask |= POLLOUT | POLLWRNORM;
+	spin_unlock_irq(&f->lock);
+
+	return mask;
+}
+
+static void sop_pt_free_rsv(struct sop_pt_file *f)
+{
+	int i;
+
+	if (!f->rsv_sgl)
 		return;
+
+	if (f->rsv_nmapped)
+		dma_unmap_sg(&f->h->pdev->dev, f->rsv_sgl, f->rsv_nchunks,
+				DMA_BIDIRECTIONAL);
+	for (i = 0; i < f->rsv_nchunks; i++)
+		__free_pages(sg_page(&f->rsv_sgl[i]),
+				get_order(f->rsv_sgl[i].length));
+	kfree(f->rsv_sgl);
+	f->rsv_sgl = NULL;
+	f->rsv_nchunks = 0;
+	f->rsv_nmapped = 0;
+	f->rsv_size = 0;
+}
+
+/* Back the reserved buffer with chunks as large as the allocator gives */
+static int sop_pt_alloc_rsv(struct sop_pt_file *f, unsigned long size)
+{
+	struct sop_device *h = f->h;
+	struct page *page;
+	unsigned long left, chunk;
+	int order, n = 0;
+
+	left = PAGE_ALIGN(size);
+	if (!left || left > h->max_hw_sectors * 512)
+		return -EINVAL;
+
+	f->rsv_sgl = kcalloc(h->max_sgls, sizeof(*f->rsv_sgl), GFP_KERNEL);
+	if (!f->rsv_sgl)
+		return -ENOMEM;
+	sg_init_table(f->rsv_sgl, h->max_sgls);
+
+	order = min_t(int, get_order(left), MAX_ORDER - 1);
+	while (left) {
+		if (n == h->max_sgls)
+			goto rsv_nomem;
+		order = min_t(int, order, get_order(left));
+		do {
+			page = alloc_pages(GFP_KERNEL | __GFP_ZERO |
+						__GFP_NOWARN, order);
+		} while (!page && order-- > 0);
+		if (!page)
+			goto rsv_nomem;
+		chunk = PAGE_SIZE << order;
+		sg_set_page(&f->rsv_sgl[n++], page, chunk, 0);
+		f->rsv_nchunks = n;
+		f->rsv_size += chunk;
+		left -= min(left, chunk);
+	}
+	sg_mark_end(&f->rsv_sgl[n - 1]);
+
+	f->rsv_nmapped = dma_map_sg(&h->pdev->dev, f->rsv_sgl, n,
+					DMA_BIDIRECTIONAL);
+	if (!f->rsv_nmapped)
+		goto rsv_nomem;
+	return 0;
+
+rsv_nomem:
+	sop_pt_free_rsv(f);
+	return -ENOMEM;
+}
+
+static int sop_pt_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct sop_pt_file *f = filp->private_data;
+	unsigned long addr = vma->vm_start;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long len;
+	int i, rc = 0;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	if (sop_pt_enter(f))
+		return -ENODEV;
+
+	mutex_lock(&f->rsv_lock);
+	if (!f->rsv_sgl)
+		rc = sop_pt_alloc_rsv(f, size);
+	else if (size > f->rsv_size)
+		rc = -ENOMEM;
+
+	for (i = 0; !rc && i < f->rsv_nchunks && addr < vma->vm_end; i++) {
+		len = min_t(unsigned long, f->rsv_sgl[i].length,
+				vma->vm_end - addr);
+		rc = remap_pfn_range(vma, addr,
+				page_to_pfn(sg_page(&f->rsv_sgl[i])),
+				len, vma->vm_page_prot);
+		addr += len;
+	}
+	mutex_unlock(&f->rsv_lock);
+	sop_pt_exit(f);
+
+	return rc;
+}
+
+static void sop_pt_free_regbuf(struct sop_device *h,
+			       struct sop_pt_regbuf *rb)
+{
+	int i;
+
+	if (rb->nmapped)
+		dma_unmap_sg(&h->pdev->dev, rb->sgl, rb->nchunks,
+				DMA_BIDIRECTIONAL);
+	for (i = 0; i < rb->npages; i++) {
+		set_page_dirty_lock(rb->pages[i]);
+		put_page(rb->pages[i]);
+	}
+	kfree(rb->pages);
+	kfree(rb->sgl);
+	memset(rb, 0, sizeof(*rb));
+}
+
+/*
+ * Pin the buffer and describe it with one sgl entry per physically
+ * contiguous run, so that a huge page costs a single descriptor.
+ */
+static int sop_pt_register_buf(struct sop_pt_file *f,
+			       struct sop_pt_buf_reg __user *ureg)
+{
+	struct sop_device *h = f->h;
+	struct sop_pt_buf_reg reg;
+	struct sop_pt_regbuf rb;
+	unsigned long addr, off, left, plen;
+	int i, n, npages, pinned, rc;
+
+	if (copy_from_user(&reg, ureg, sizeof(reg)))
+		return -EFAULT;
+	if (!reg.len || reg.len > INT_MAX)
+		return -EINVAL;
+
+	memset(&rb, 0, sizeof(rb));
+	addr = (unsigned long) reg.addr;
+	off = offset_in_page(addr);
+	rb.len = reg.len;
+	npages = DIV_ROUND_UP(off + reg.len, PAGE_SIZE);
+	rb.pages = kcalloc(npages, sizeof(*rb.pages), GFP_KERNEL);
+	rb.sgl = kcalloc(npages, sizeof(*rb.sgl), GFP_KERNEL);
+	rc = -ENOMEM;
+	if (!rb.pages || !rb.sgl)
+		goto reg_fail;
+
+	pinned = get_user_pages_fast(addr & PAGE_MASK, npages, 1, rb.pages);
+	rb.npages = max(pinned, 0);
+	if (pinned < npages) {
+		rc = -EFAULT;
+		goto reg_fail;
+	}
+
+	sg_init_table(rb.sgl, rb.npages);
+	left = reg.len;
+	for (i = 0, n = 0; i < rb.npages; i++) {
+		plen = min(PAGE_SIZE - off, left);
+		if (n && page_to_pfn(rb.pages[i]) ==
+				page_to_pfn(rb.pages[i - 1]) + 1)
+			rb.sgl[n - 1].length += plen;
+		else
+			sg_set_page(&rb.sgl[n++], rb.pages[i], plen, off);
+		left -= plen;
+		off = 0;
+	}
+	sg_mark_end(&rb.sgl[n - 1]);
+	rb.nchunks = n;
+
+	rb.nmapped = dma_map_sg(&h->pdev->dev, rb.sgl, n, DMA_BIDIRECTIONAL);
+	if (!rb.nmapped)
+		goto reg_fail;
+
+	rc = -EBUSY;
+	spin_lock_irq(&f->lock);
+	for (i = 0; i < SOP_PT_MAX_REGBUF; i++)
+		if (!f->regbuf[i].nmapped) {
+			f->regbuf[i] = rb;
+			rc = 0;
+			break;
+		}
+	spin_unlock_irq(&f->lock);
+	if (rc)
+		goto reg_fail;
+
+	if ((sop_dbg_lvl & SOP_DBG_LVL_DUMP_SGIO))
+		dev_warn(&h->pdev->dev,
+			"PT buffer %d: %llu bytes, %d pages in %d segments\n",
+			i, rb.len, rb.npages, rb.nmapped);
+
+	reg.index = i;
+	if (put_user(reg.index, &ureg->index))
+		return -EFAULT;
+	return 0;
+
+reg_fail:
+	sop_pt_free_regbuf(h, &rb);
+	return rc;
+}
+
+static int sop_pt_unregister_buf(struct sop_pt_file *f, u32 __user *uindex)
+{
+	struct sop_pt_regbuf rb;
+	u32 index;
+	int rc = 0;
+
+	if (get_user(index, uindex))
+		return -EFAULT;
+	if (index >= SOP_PT_MAX_REGBUF)
+		return -EINVAL;
+
+	spin_lock_irq(&f->lock);
+	if (!f->regbuf[index].nmapped)
+		rc = -EINVAL;
+	else if (atomic_read(&f->regbuf[index].users))
+		rc = -EBUSY;
+	else {
+		rb = f->regbuf[index];
+		memset(&f->regbuf[index], 0, sizeof(rb));
+	}
+	spin_unlock_irq(&f->lock);
+
+	if (!rc)
+		sop_pt_free_regbuf(f->h, &rb);
+	return rc;
+}
+
+static long sop_pt_ioctl(struct file *filp, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct sop_pt_file *f = filp->private_data;
+	long rc;
+
+	if (sop_pt_enter(f))
+		return -ENODEV;
+
+	switch (cmd) {
+	case SG_IO:
+		rc = sop_sg_io(f->h, filp->f_mode, (void __user *) arg, f);
+		break;
+	case SOP_PT_IOC_REGISTER:
+		rc = sop_pt_register_buf(f, (void __user *) arg);
+		break;
+	case SOP_PT_IOC_UNREGISTER:
+		rc = sop_pt_unregister_buf(f, (void __user *) arg);
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+
+	sop_pt_exit(f);
+	return rc;
+}
+
+static void sop_pt_free_file(struct sop_pt_file *f)
+{
+	int i;
+
+	sop_pt_free_rsv(f);
+	for (i = 0; i < SOP_PT_MAX_REGBUF; i++)
+		if (f->regbuf[i].nmapped)
+			sop_pt_free_regbuf(f->h, &f->regbuf[i]);
+
+	for (i = 0; i < SOP_PT_DEPTH; i++) {
+		kfree(f->req[i].sgl);
+		kfree(f->req[i].page_map);
+	}
+	kfree(f);
+}
+
+static int sop_pt_open(struct inode *inode, struct file *filp)
+{
+	struct sop_device *h = NULL, *d;
+	struct sop_pt_file *f;
+	struct sop_pt_req *pr;
+	int i;
+
+	if (!capable(CAP_SYS_RAWIO))
+		return -EPERM;
+
+	spin_lock(&dev_list_lock);
+	list_for_each_entry(d, &dev_list, node)
+		if (d->ptdev.minor == iminor(inode)) {
+			h = d;
+			kref_get(&h->ref);
+			break;
+		}
+	spin_unlock(&dev_list_lock);
+	if (!h)
+		return -ENODEV;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f) {
+		kref_put(&h->ref, sop_free_device);
+		return -ENOMEM;
+	}
+	f->h = h;
+	spin_lock_init(&f->lock);
+	INIT_LIST_HEAD(&f->free);
+	INIT_LIST_HEAD(&f->done);
+	init_waitqueue_head(&f->wait);
+	mutex_init(&f->rsv_lock);
+
+	/* Everything a command needs is set up here, not per submission */
+	for (i = 0; i < SOP_PT_DEPTH; i++) {
+		pr = &f->req[i];
+		pr->f = f;
+		pr->sgl = kcalloc(h->max_sgls, sizeof(*pr->sgl), GFP_KERNEL);
+		pr->page_map = kcalloc(h->max_sgls, sizeof(*pr->page_map),
+					GFP_KERNEL);
+		if (!pr->sgl || !pr->page_map) {
+			sop_pt_free_file(f);
+			kref_put(&h->ref, sop_free_device);
+			return -ENOMEM;
+		}
+		sg_init_table(pr->sgl, h->max_sgls);
+		list_add_tail(&pr->entry, &f->free);
+	}
+
+	/* misc_deregister() in remove waits for open, so h is still live */
+	mutex_lock(&h->pt_mutex);
+	list_add_tail(&f->node, &h->pt_files);
+	mutex_unlock(&h->pt_mutex);
+
+	filp->private_data = f;
+	return nonseekable_open(inode, filp);
+}
+
+static int sop_pt_idle(struct sop_pt_file *f)
+{
+	int ret;
+
+	spin_lock_irq(&f->lock);
+	ret = (f->pending == 0);
+	spin_unlock_irq(&f->lock);
+	return ret;
+}
+
+static int sop_pt_release(struct inode *inode, struct file *filp)
+{
+	struct sop_pt_file *f = filp->private_data;
+	struct sop_device *h = f->h;
+
+	/*
+	 * The device still owns the buffers of what is outstanding.  A
+	 * dead file was drained by remove, whatever it still holds is no
+	 * longer DMA mapped.
+	 */
+	mutex_lock(&h->pt_mutex);
+	list_del_init(&f->node);
+	wait_event(f->wait, sop_pt_idle(f));
+	sop_pt_free_file(f);
+	mutex_unlock(&h->pt_mutex);
+
+	kref_put(&h->ref, sop_free_device);
+	return 0;
+}
+
+/*
+ * Remove: no file operation gets to the device any more, once those
+ * in progress are done.  Their commands are failed with the rest.
+ */
+static void sop_pt_kill_files(struct sop_device *h)
+{
+	struct sop_pt_file *f;
+
+	down_write(&h->pt_rwsem);
+	mutex_lock(&h->pt_mutex);
+	list_for_each_entry(f, &h->pt_files, node) {
+		spin_lock_irq(&f->lock);
+		f->dead = 1;
+		spin_unlock_irq(&f->lock);
+		wake_up(&f->wait);
+	}
+	mutex_unlock(&h->pt_mutex);
+	up_write(&h->pt_rwsem);
+}
+
+/*
+ * Remove, once the commands are failed: give back the DMA mappings the
+ * files still hold.  The reserved pages stay until release since they
+ * may still be mapped in userspace.
+ */
+static void sop_pt_drain_files(struct sop_device *h)
+{
+	struct sop_pt_file *f, *n;
+	int i;
+
+	mutex_lock(&h->pt_mutex);
+	list_for_each_entry_safe(f, n, &h->pt_files, node) {
+		wait_event(f->wait, sop_pt_idle(f));
+
+		mutex_lock(&f->rsv_lock);
+		if (f->rsv_nmapped)
+			dma_unmap_sg(&h->pdev->dev, f->rsv_sgl,
+					f->rsv_nchunks, DMA_BIDIRECTIONAL);
+		f->rsv_nmapped = 0;
+		mutex_unlock(&f->rsv_lock);
+
+		for (i = 0; i < SOP_PT_MAX_REGBUF; i++)
+			if (f->regbuf[i].nmapped)
+				sop_pt_free_regbuf(h, &f->regbuf[i]);
+		list_del_init(&f->node);
 	}
-	atomic_dec(&q->tmo.time_slot[tmo_slot]);
+	mutex_unlock(&h->pt_mutex);
+}
+
+static void sop_free_device(struct kref *ref)
+{
+	kfree(container_of(ref, struct sop_device, ref));
+}
+
+static const struct file_operations sop_pt_fops = {
+	.owner		= THIS_MODULE,
+	.open		= sop_pt_open,
+	.release	= sop_pt_release,
+	.read		= sop_pt_read,
+	.write		= sop_pt_write,
+	.poll		= sop_pt_poll,
+	.mmap		= sop_pt_mmap,
+	.unlocked_ioctl	= sop_pt_ioctl,
+	.llseek		= no_llseek,
+};
+
+static int sop_pt_register(struct sop_device *h)
+{
+	snprintf(h->ptname, SOP_MAXNAME_LEN, "%s_pt", h->devname);
+	h->ptdev.minor = MISC_DYNAMIC_MINOR;
+	h->ptdev.name = h->ptname;
+	h->ptdev.fops = &sop_pt_fops;
+	return misc_register(&h->ptdev);
+}
+
+static void sop_init_timeout(struct sop_timeout *tmo)
+{
+	int level, i;
+
+	spin_lock_init(&tmo->lock);
+	tmo->cur_tick = 0;
+	for (level = 0; level < SOP_TMO_WHEEL_LEVELS; level++)
+		for (i = 0; i < SOP_TMO_WHEEL_SIZE; i++)
+			INIT_LIST_HEAD(&tmo->wheel[level][i]);
+}
+
+/* Link the request into the wheel, replacing any previous deadline */
+static void sop_add_timeout(struct queue_info *q, struct sop_request *r,
+			    u32 msecs)
+{
+	struct sop_timeout *tmo = &q->tmo;
+	struct list_head *slot;
+	unsigned long ticks, flags;
+
+	ticks = DIV_ROUND_UP(msecs, SOP_TMO_TICK_MS);
+	ticks = clamp_t(unsigned long, ticks, 1, SOP_TMO_MAX_TICKS);
+
+	spin_lock_irqsave(&tmo->lock, flags);
+	r->tmo_deadline = tmo->cur_tick + ticks;
+	if (ticks < SOP_TMO_WHEEL_SIZE)
+		slot = &tmo->wheel[0][r->tmo_deadline & SOP_TMO_WHEEL_MASK];
+	else
+		slot = &tmo->wheel[1][(r->tmo_deadline >> SOP_TMO_WHEEL_BITS) &
+					SOP_TMO_WHEEL_MASK];
+	list_move_tail(&r->tmo_entry, slot);
+	spin_unlock_irqrestore(&tmo->lock, flags);
+}
+
+/* Safe to call more than once, or on a request that already timed out */
+static void sop_rem_timeout(struct queue_info *q, struct sop_request *r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->tmo.lock, flags);
+	list_del_init(&r->tmo_entry);
+	spin_unlock_irqrestore(&q->tmo.lock, flags);
 }
 
 static void sop_fail_cmd(struct queue_info *q, struct sop_request *r)
@@ -4350,6 +7677,37 @@ static void sop_fail_cmd(struct queue_info *q, struct sop_request *r)
 	atomic_dec(&q->cur_qdepth);
 }
 
+/* Take back a bio the device will not complete and queue it again */
+static void sop_requeue_cmd(struct queue_info *q, struct sop_request *r)
+{
+	struct sop_device *h = q->h;
+	struct bio *bio = r->bio;
+	enum dma_data_direction dma_dir;
+	unsigned long flags;
+
+	if (r->retry_count > MAX_RETRY_COUNT) {
+		sop_fail_cmd(q, r);
+		return;
+	}
+
+	sop_end_io_acct(bio, r->start_time);
+	if (bio_data_dir(bio) == WRITE)
+		dma_dir = DMA_TO_DEVICE;
+	else
+		dma_dir = DMA_FROM_DEVICE;
+	dma_unmap_sg(&h->pdev->dev, r->sgl, r->num_sg, dma_dir);
+
+	/* Update counters originally done in ISR */
+	atomic_dec(&h->cmd_pending);
+	atomic_dec(&q->cur_qdepth);
+
+	spin_lock_irqsave(&q->iq->qlock, flags);
+	sop_flush_takeback(q, r);
+	free_request(h, &h->io_req[q->numa_node], r->request_id);
+	sop_queue_cmd(q, bio);
+	spin_unlock_irqrestore(&q->iq->qlock, flags);
+}
+
 /* To be called instead of sop_process_bio in case of abort */
 static int sop_fail_bio(struct sop_device *h, struct bio *bio,
 			struct queue_info *q)
@@ -4361,6 +7719,22 @@ static int sop_fail_bio(struct sop_device *h, struct bio *bio,
 	return 0;
 }
 
+/* Flushes left waiting for a sync that will now never be sent */
+static void sop_fail_flush_wait(struct queue_info *q)
+{
+	struct bio_list bl;
+	struct bio *bio;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->iq->qlock, flags);
+	bl = q->flush_wait;
+	bio_list_init(&q->flush_wait);
+	spin_unlock_irqrestore(&q->iq->qlock, flags);
+
+	while ((bio = bio_list_pop(&bl)))
+		sop_fail_bio(q->h, bio, q);
+}
+
 static void sop_timeout_sync_cmd(struct queue_info *q, struct sop_request *r)
 {
 	/* Fill a fake error completion in r->response */
@@ -4368,16 +7742,16 @@ static void sop_timeout_sync_cmd(struct queue_info *q, struct sop_request *r)
 	r->response_accumulated = 1;
 
 	/* Complete sync cmd */
-	if (r->waiting)
-		complete(r->waiting);
+	if (r->pt)
+		sop_complete_pt(q->h, q, r);
 	else
-		dev_err(&q->h->pdev->dev,
-			"TMO: bio and waiting both NULL for Q[%d], rqid %d\n",
-				q->oq->queue_id, r->request_id);
+		sop_wake_waiter(q->h, q, r);
 
-	/* Update counters originally done in ISR */
-	atomic_dec(&q->h->cmd_pending);
-	atomic_dec(&q->cur_qdepth);
+	/* Update counters originally done in ISR (not kept for admin) */
+	if (qinfo_to_qid(q)) {
+		atomic_dec(&q->h->cmd_pending);
+		atomic_dec(&q->cur_qdepth);
+	}
 }
 
 #define SOP_ERR_NONE		0
@@ -4413,113 +7787,415 @@ static int sop_device_error_state(struct sop_device *h)
 	return SOP_ERR_NONE;
 }
 
-/* tmo_slot is negative if all commands are to be failed */
-static int sop_timeout_queued_cmds(struct queue_info *q,
-					int tmo_slot, int action)
+static struct sop_request_pool *sop_qinfo_pool(struct queue_info *q)
+{
+	int qid = qinfo_to_qid(q);
+
+	if (qid && qid == q->h->mgmt_qpindex)
+		return &q->h->mgmt_req;
+	if (qid)
+		return &q->h->io_req[q->numa_node];
+	return &q->h->admin_req;
+}
+
+static void sop_queue_recovery(struct sop_device *h, struct sop_request *r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&h->recovery_lock, flags);
+	r->tmo_stage = SOP_TMO_ABORT;
+	list_add_tail(&r->recovery_entry, &h->recovery_list);
+	spin_unlock_irqrestore(&h->recovery_lock, flags);
+
+	queue_work(h->wq, &h->recovery_work);
+}
+
+/* The request is finished one way or another: drop it from recovery */
+static void sop_recovery_done(struct sop_device *h, struct sop_request *r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&h->recovery_lock, flags);
+	list_del_init(&r->recovery_entry);
+	r->tmo_stage = SOP_TMO_NONE;
+	spin_unlock_irqrestore(&h->recovery_lock, flags);
+}
+
+/*
+ * Dispose of a command that timed out or has to be given up on.
+ * Returns 0 if the request is still outstanding on the device.
+ * Must be called by the owner of the outbound queue.
+ */
+static int sop_expire_cmd(struct queue_info *q, struct sop_request *ser,
+				int action)
 {
 	struct sop_device *h = q->h;
-	struct sop_request_pool *p;
+
+	switch (action) {
+	case SOP_ERR_DEV_REM:
+		sop_recovery_done(h, ser);
+		if (ser->bio)
+			sop_fail_cmd(q, ser);
+		else
+			sop_timeout_sync_cmd(q, ser);
+		return 1;
+
+	case SOP_ERR_NONE:
+	case SOP_ERR_DEV_FAULT:
+		ser->retry_count++;
+
+		/*
+		 * Try to get back only this command first.  Admin and task
+		 * management commands, a command that is already being
+		 * recovered and a faulted device need the controller reset.
+		 */
+		if (action == SOP_ERR_NONE && qinfo_to_qid(q) &&
+		    ser->tmo_stage == SOP_TMO_NONE) {
+			sop_queue_recovery(h, ser);
+			return 0;
+		}
+		set_bit(SOP_FLAGS_BITPOS_DO_RESET, &h->flags);
+
+		/* Do not free request - it will be done at RESET */
+		return 0;
+
+	case SOP_ERR_DEV_RESET:
+		/*
+		 * Requeue this command and
+		 * reset the controller at end
+		 */
+		sop_recovery_done(h, ser);
+		if (ser->bio)
+			sop_requeue_cmd(q, ser);
+		else
+			sop_timeout_sync_cmd(q, ser);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Give up on every command outstanding on this queue */
+static int sop_timeout_queued_cmds(struct queue_info *q, int action)
+{
+	struct sop_request_pool *p = sop_qinfo_pool(q);
 	int rqid, maxid;
 	int count = 0;
 	struct sop_request *ser;
 	u16 qid;
 
 	qid = qinfo_to_qid(q);
-	if ((qid))
-		p = &h->io_req[q->numa_node];
-	else
-		p = &h->admin_req;
 
-	/* Process timeout by linear search of request bits in qinfo*/
-	maxid = p->num_requests - 1;
-	for_each_set_bit(rqid, p->request_bits, maxid) {
-		ser = &p->request[rqid];
-		if ((action == SOP_ERR_NONE) && (ser->tmo_slot != tmo_slot)
-						&& (qid == ser->qid))
-			continue;
+	/* The pool is shared by the queues of a node: pick out ours */
+	maxid = p->num_requests - 1;
+	for_each_set_bit(rqid, p->request_bits, maxid) {
+		ser = &p->request[rqid];
+		if (ser->qid != qid)
+			continue;
+
+		sop_rem_timeout(q, ser);
+		sop_expire_cmd(q, ser, action);
+		count++;
+	}
+
+	return count;
+}
+
+/* Move the level 1 bucket that is now due down into level 0 */
+static void sop_tmo_cascade(struct sop_timeout *tmo)
+{
+	struct sop_request *ser, *tmp;
+	struct list_head *slot;
+
+	slot = &tmo->wheel[1][(tmo->cur_tick >> SOP_TMO_WHEEL_BITS) &
+				SOP_TMO_WHEEL_MASK];
+	list_for_each_entry_safe(ser, tmp, slot, tmo_entry)
+		list_move_tail(&ser->tmo_entry,
+			&tmo->wheel[0][ser->tmo_deadline & SOP_TMO_WHEEL_MASK]);
+}
+
+/* Advance the wheel by one tick and expire what is due */
+static void sop_timeout_ios(struct queue_info *q, int action)
+{
+	struct sop_timeout *tmo = &q->tmo;
+	struct sop_request *ser;
+	unsigned long flags;
+	int count = 0;
+	LIST_HEAD(expired);
+
+	spin_lock_irqsave(&tmo->lock, flags);
+	tmo->cur_tick++;
+	if (!(tmo->cur_tick & SOP_TMO_WHEEL_MASK))
+		sop_tmo_cascade(tmo);
+	list_splice_init(&tmo->wheel[0][tmo->cur_tick & SOP_TMO_WHEEL_MASK],
+				&expired);
+	spin_unlock_irqrestore(&tmo->lock, flags);
+
+	/*
+	 * A waiter may still take its request off the expired list
+	 * with sop_rem_timeout(), so unlink one at a time under the lock.
+	 */
+	for (;;) {
+		spin_lock_irqsave(&tmo->lock, flags);
+		if (list_empty(&expired)) {
+			spin_unlock_irqrestore(&tmo->lock, flags);
+			break;
+		}
+		ser = list_first_entry(&expired, struct sop_request, tmo_entry);
+		list_del_init(&ser->tmo_entry);
+		spin_unlock_irqrestore(&tmo->lock, flags);
+
+		if (count++ == 0) {
+			dev_warn(&q->h->pdev->dev,
+				"SOP timeout!! Q[%d] tick %lu rqid %d\n",
+				qinfo_to_qid(q), tmo->cur_tick,
+				ser->request_id);
+			sop_dump_log(0);
+			sop_dump_log(1);
+		}
+		sop_expire_cmd(q, ser, action);
+	}
+
+	if (count > 1)
+		dev_warn(&q->h->pdev->dev, "SOP timeout!! %d cmds on Q[%d]\n",
+				count, qinfo_to_qid(q));
+}
+
+/*
+ * Send a task management function on the given queue pair and wait for
+ * it.  Returns 0 if the device reports the function complete.
+ */
+static int sop_send_task_mgmt(struct sop_device *h, struct queue_info *qinfo,
+				u8 tmf, u16 request_id_to_manage)
+{
+	struct sop_request_pool *p = sop_qinfo_pool(qinfo);
+	struct sop_task_mgmt_iu *r;
+	struct sop_task_mgmt_response *resp;
+	struct sop_request *ser;
+	DECLARE_COMPLETION_ONSTACK(wait);
+	u16 request_id;
+	int rc = 0;
+
+	spin_lock_irq(&qinfo->iq->qlock);
+	request_id = alloc_request(h, p);
+	if (request_id == (u16) -EBUSY) {
+		spin_unlock_irq(&qinfo->iq->qlock);
+		return -EBUSY;
+	}
+	r = pqi_alloc_elements(qinfo->iq, 1);
+	if (IS_ERR(r)) {
+		free_request(h, p, request_id);
+		spin_unlock_irq(&qinfo->iq->qlock);
+		return -EBUSY;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->iu_type = SOP_TASK_MGMT_IU;
+	r->iu_length = cpu_to_le16(sizeof(*r) - PQI_IU_HEADER_SIZE);
+	r->queue_id = cpu_to_le16(qinfo_to_qid(qinfo));
+	r->request_id = request_id;
+	r->request_id_to_manage = request_id_to_manage;
+	r->task_mgmt_function = tmf;
+
+	ser = &p->request[request_id];
+	ser->qid = qinfo_to_qid(qinfo);
+	ser->request_id = request_id;
+	ser->bio = NULL;
+	ser->num_sg = 0;
+	ser->retry_count = 0;
+	ser->tmo_stage = SOP_TMO_TMF;
+	ser->waiting = &wait;
+	ser->response_accumulated = 0;
+	sop_add_timeout(qinfo, ser, SOP_TMF_TIMEOUT * MSEC_PER_SEC);
+	atomic_inc(&qinfo->cur_qdepth);
+	atomic_inc(&h->cmd_pending);
+	pqi_notify_device_queue_written(qinfo->iq);
+	spin_unlock_irq(&qinfo->iq->qlock);
+	if (!wait_for_completion_timeout(&wait,
+			msecs_to_jiffies(SOP_TMF_WAIT * MSEC_PER_SEC))) {
+		/*
+		 * Neither the device nor the timeout wheel answered.  Leave
+		 * the request to the controller reset; unless a completion
+		 * is already on its way, then it is only a moment.
+		 */
+		set_bit(SOP_FLAGS_BITPOS_DO_RESET, &h->flags);
+		if (xchg(&ser->waiting, NULL)) {
+			dev_warn(&h->pdev->dev,
+				"TMF 0x%02x for rqid %d got no answer\n",
+				tmf, request_id_to_manage);
+			return -ETIMEDOUT;
+		}
+		wait_for_completion(&wait);
+	}
+	sop_rem_timeout(qinfo, ser);
+
+	resp = (struct sop_task_mgmt_response *) ser->response;
+	if (resp->iu_type != SOP_RESPONSE_TASK_MGMT_RESPONSE_IU_TYPE ||
+	    (resp->response_code != SOP_TMF_COMPLETE &&
+	     resp->response_code != SOP_TMF_SUCCEEDED)) {
+		dev_warn(&h->pdev->dev,
+			"TMF 0x%02x for rqid %d failed: IU 0x%02x code 0x%02x\n",
+			tmf, request_id_to_manage, resp->iu_type,
+			resp->response_code);
+		rc = -EIO;
+	}
+	free_request(h, p, request_id);
+	sop_kick_node_wait_lists(h, qinfo->numa_node);
+
+	return rc;
+}
+
+/* The abort is done with the tag, free it if the command was freed */
+static void sop_release_tag(struct sop_device *h, struct queue_info *q,
+			    struct sop_request *r)
+{
+	int freed;
+
+	spin_lock_irq(&h->recovery_lock);
+	r->tag_hold = 0;
+	freed = r->tag_freed;
+	r->tag_freed = 0;
+	spin_unlock_irq(&h->recovery_lock);
+
+	if (freed) {
+		free_request(h, sop_qinfo_pool(q), r->request_id);
+		sop_kick_node_wait_lists(h, q->numa_node);
+	}
+}
+
+/* The device dropped an aborted command: give it back unless it completed */
+static void sop_reclaim_cmd(struct queue_info *q, struct sop_request *ser)
+{
+	struct sop_device *h = q->h;
+	int pending;
+
+	local_irq_disable();
+	sop_oq_claim(q);
+
+	/* A completion that raced with the abort wins */
+	sop_msix_handle_ioq(q);
+	spin_lock(&h->recovery_lock);
+	pending = !list_empty(&ser->recovery_entry);
+	spin_unlock(&h->recovery_lock);
+	if (pending)
+		sop_expire_cmd(q, ser, SOP_ERR_DEV_RESET);
+
+	sop_oq_release(q, sop_msix_handle_ioq);
+	local_irq_enable();
+}
+
+/* A LUN reset terminated everything that was outstanding: take it back */
+static void sop_reclaim_lun(struct sop_device *h)
+{
+	struct sop_request_pool *p;
+	struct sop_request *ser;
+	struct queue_info *q;
+	int i, rqid, maxid;
+	u16 qid;
+
+	for (i = 1; i < h->nr_queue_pairs; i++) {
+		q = &h->qinfo[i];
 
-		/* Take the queue for this command */
-		q = &h->qinfo[ser->qid];
+		if (!q->oq)
+			continue;
 
-		/* Found a timed out command, process timeout */
-		count++;
+		qid = qinfo_to_qid(q);
+		p = sop_qinfo_pool(q);
+		maxid = p->num_requests - 1;
 
-		switch (action) {
-		case SOP_ERR_DEV_REM:
-			if (ser->bio)
-				sop_fail_cmd(q, ser);
-			else
-				sop_timeout_sync_cmd(q, ser);
-			break;
+		local_irq_disable();
+		sop_oq_claim(q);
+		sop_msix_handle_ioq(q);
 
-		case SOP_ERR_NONE:
-		case SOP_ERR_DEV_FAULT:
-			/* TODO: Need to abort this command */
-			/* For now, reset the controller only */
-			set_bit(SOP_FLAGS_BITPOS_DO_RESET, &h->flags);
+		/*
+		 * Everything posted on this queue so far was hit by the
+		 * reset.  Mark it under the submission lock so commands
+		 * issued after we let go of it are left alone.
+		 */
+		spin_lock(&q->iq->qlock);
+		for_each_set_bit(rqid, p->request_bits, maxid) {
+			ser = &p->request[rqid];
+			if (ser->qid == qid)
+				ser->tmo_stage = SOP_TMO_LUN_RESET;
+		}
+		spin_unlock(&q->iq->qlock);
 
-			/* Remove from timer so it doesn't timeout again */
-			ser->tmo_slot = INVALID_TIMEOUT;
-			ser->retry_count++;
+		for_each_set_bit(rqid, p->request_bits, maxid) {
+			ser = &p->request[rqid];
+			if (ser->qid != qid ||
+			    ser->tmo_stage != SOP_TMO_LUN_RESET)
+				continue;
+			sop_rem_timeout(q, ser);
+			sop_expire_cmd(q, ser, SOP_ERR_DEV_RESET);
+		}
 
-			/* Do not free request - it will be done at RESET */
-			continue;
+		sop_oq_release(q, sop_msix_handle_ioq);
+		local_irq_enable();
 
-		case SOP_ERR_DEV_RESET:
-			/*
-			 * Requeue this command and
-			 * reset the controller at end
-			 */
-			if (ser->bio) {
-				spin_lock_irq(&q->iq->qlock);
-				if (ser->retry_count > MAX_RETRY_COUNT)
-					sop_fail_cmd(q, ser);
-				else
-					sop_queue_cmd(q, ser->bio);
-				spin_unlock_irq(&q->iq->qlock);
-			} else {
-				sop_timeout_sync_cmd(q, ser);
-			}
-			break;
-		}
-		/* Free the sop request now */
-		atomic_dec(&h->cmd_pending);
-		atomic_dec(&q->cur_qdepth);
-		clear_bit(rqid, p->request_bits);
+		sop_resubmit_wait_list(q, sop_process_bio);
 	}
-
-	return count;
 }
 
-static void sop_timeout_ios(struct queue_info *q, int action)
+/*
+ * Work through timed out commands: abort the command first, then reset
+ * the LUN and only when that fails too fall back to a controller reset.
+ */
+static void sop_recovery_wq(struct work_struct *work)
 {
-	int cmd_pend;
-	u8 cur_slot;
-
-	/* Update the current slot */
-	cur_slot = (atomic_read(&q->tmo.cur_slot) + 1) % MAX_SOP_TIMEOUT;
-	atomic_set(&q->tmo.cur_slot, cur_slot);
-
-	/* Check if the current slot is empty, otherwise... */
-	cmd_pend = atomic_read(&q->tmo.time_slot[cur_slot]);
-	if (cmd_pend == 0)
-		return;
+	struct sop_device *h = container_of(work, struct sop_device,
+						recovery_work);
+	struct sop_request *ser;
+	struct queue_info *q;
+	u16 request_id;
+	u8 stage;
 
-	dev_warn(&q->h->pdev->dev, "SOP timeout!! %d cmds left on Q[%d] slot[%d]\n",
-				cmd_pend, qinfo_to_qid(q), cur_slot);
-	sop_dump_log(0);
-	sop_dump_log(1);
+	while (!SOP_DEVICE_BUSY(h) && !SOP_DEVICE_REM(h)) {
+		spin_lock_irq(&h->recovery_lock);
+		if (list_empty(&h->recovery_list)) {
+			spin_unlock_irq(&h->recovery_lock);
+			break;
+		}
+		ser = list_first_entry(&h->recovery_list, struct sop_request,
+					recovery_entry);
+		stage = ser->tmo_stage;
+		request_id = ser->request_id;
+		q = &h->qinfo[ser->qid];
+		if (stage == SOP_TMO_ABORT)
+			ser->tag_hold = 1;
+		spin_unlock_irq(&h->recovery_lock);
+
+		if (stage == SOP_TMO_ABORT) {
+			dev_warn(&h->pdev->dev, "Aborting rqid %d on Q[%d]\n",
+				request_id, qinfo_to_qid(q));
+			if (sop_send_task_mgmt(h, q, SOP_ABORT_TASK,
+						request_id) == 0) {
+				sop_reclaim_cmd(q, ser);
+				sop_release_tag(h, q, ser);
+				sop_resubmit_wait_list(q, sop_process_bio);
+				continue;
+			}
+			sop_release_tag(h, q, ser);
 
-	/* Process timeout */
-	cmd_pend -= sop_timeout_queued_cmds(q, cur_slot, action);
+			/* Still there: move up to a LUN reset */
+			spin_lock_irq(&h->recovery_lock);
+			if (!list_empty(&ser->recovery_entry))
+				ser->tmo_stage = SOP_TMO_LUN_RESET;
+			spin_unlock_irq(&h->recovery_lock);
+			continue;
+		}
 
-	if ((action == SOP_ERR_NONE) && cmd_pend)
-		dev_warn(&q->h->pdev->dev, "SOP timeout!! Q[%d] Slot [%d] "
-				"Cannot account for %d cmds\n",
-				qinfo_to_qid(q), cur_slot, cmd_pend);
+		dev_warn(&h->pdev->dev, "Resetting LUN for rqid %d on Q[%d]\n",
+			request_id, qinfo_to_qid(q));
+		if (sop_send_task_mgmt(h, q, SOP_LUN_RESET, 0) == 0) {
+			sop_reclaim_lun(h);
+			continue;
+		}
 
-	/* Reset the count of the curremnt slot */
-	atomic_set(&q->tmo.time_slot[cur_slot], 0);
+		/* Last resort, the reset takes back whatever is left */
+		dev_warn(&h->pdev->dev, "LUN reset failed, resetting controller\n");
+		set_bit(SOP_FLAGS_BITPOS_DO_RESET, &h->flags);
+		break;
+	}
 }
 
 static void sop_resubmit_wait_list(struct queue_info *qinfo,
@@ -4527,30 +8203,114 @@ static void sop_resubmit_wait_list(struct queue_info *qinfo,
 			   struct queue_info *qinfo))
 {
 	struct bio_list *bl;
+	struct bio_list failed;
 	struct sop_device *h;
+	struct bio *bio;
 	int ret;
 	unsigned long flags;
 
 	h = qinfo->h;
 	bl = &qinfo->wait_list;
+	bio_list_init(&failed);
 
 	spin_lock_irqsave(&qinfo->iq->qlock, flags);
 	while (bio_list_peek(bl)) {
-		struct bio *bio = bio_list_pop(bl);
+		bio = bio_list_pop(bl);
 
 		ret = bio_process(h, bio, qinfo);
-		if (ret) {
+		if (ret == -EIO)
+			bio_list_add(&failed, bio);
+		else if (ret) {
 			bio_list_add_head(bl, bio);
 			break;
 		}
 		qinfo->waitlist_depth--;
+		sop_wait_exit(qinfo);
 	}
+
+	/* Nothing outstanding will complete to drain the rest for us */
+	if (!bio_list_empty(bl) && !atomic_read(&qinfo->cur_qdepth))
+		sop_arm_drain(qinfo);
 	spin_unlock_irqrestore(&qinfo->iq->qlock, flags);
+
+	/* bi_end_io may submit more I/O, so not under the queue lock */
+	while ((bio = bio_list_pop(&failed))) {
+		atomic_dec(&h->bio_count);
+		bio_endio(bio, -EIO);
+	}
+}
+
+/*
+ * Post the saved IU of a command that was outstanding when the queues
+ * were re-created.  Its DMA mapping and chained SGL are still valid.
+ * Called with iq->qlock held.
+ */
+static int sop_replay_cmd(struct queue_info *q, struct sop_request *ser)
+{
+	struct sop_limited_cmd_iu *r;
+
+	r = pqi_alloc_elements(q->iq, 1);
+	if (IS_ERR(r))
+		return PTR_ERR(r);
+
+	memcpy(r, ser->iu, IQ_IU_SIZE);
+	r->queue_id = cpu_to_le16(q->oq->queue_id);
+	sop_add_timeout(q, ser, DEF_IO_TIMEOUT * MSEC_PER_SEC);
+	return 0;
+}
+
+/*
+ * Re-post every bio command outstanding on this queue as it was, on the
+ * same queue, with a single doorbell.  What cannot be replayed goes back
+ * through the wait list.  Must be called by the owner of the outbound
+ * queue.
+ */
+static int sop_replay_queued_cmds(struct queue_info *q)
+{
+	struct sop_request_pool *p = sop_qinfo_pool(q);
+	struct sop_request *ser;
+	int rqid, maxid;
+	int posted = 0;
+	u16 qid;
+	int rc;
+
+	qid = qinfo_to_qid(q);
+	maxid = p->num_requests - 1;
+	for_each_set_bit(rqid, p->request_bits, maxid) {
+		ser = &p->request[rqid];
+		if (ser->qid != qid)
+			continue;
+
+		sop_rem_timeout(q, ser);
+		if (!ser->bio || ser->retry_count > MAX_RETRY_COUNT) {
+			sop_expire_cmd(q, ser, SOP_ERR_DEV_RESET);
+			continue;
+		}
+
+		sop_recovery_done(q->h, ser);
+		spin_lock(&q->iq->qlock);
+		rc = sop_replay_cmd(q, ser);
+		spin_unlock(&q->iq->qlock);
+		if (rc) {
+			sop_requeue_cmd(q, ser);
+			continue;
+		}
+		posted++;
+	}
+
+	if (posted) {
+		spin_lock(&q->iq->qlock);
+		writew(q->iq->unposted_index, q->iq->index.to_dev.pi);
+		spin_unlock(&q->iq->qlock);
+	}
+
+	return posted;
 }
 
 static void sop_requeue_all_outstanding_io(struct sop_device *h)
 {
 	int i;
+	int count = 0;
 	struct queue_info *q;
 
 	/* Io Queue */
@@ -4560,15 +8320,21 @@ static void sop_requeue_all_outstanding_io(struct sop_device *h)
 		if (!q->oq)
 			continue;
 
-		spin_lock_irq(&q->oq->qlock);
+		local_irq_disable();
+		sop_oq_claim(q);
 
 		/* Process any pending ISR */
 		sop_msix_handle_ioq(q);
-		/* Requeue all outstanding commands given to this HW queue */
-		sop_timeout_queued_cmds(q, -1, SOP_ERR_DEV_RESET);
+		/* Replay all outstanding commands given to this HW queue */
+		count += sop_replay_queued_cmds(q);
 
-		spin_unlock_irq(&q->oq->qlock);
+		sop_oq_release(q, sop_msix_handle_ioq);
+		local_irq_enable();
 	}
+
+	if (count)
+		dev_warn(&h->pdev->dev, "Replayed %d outstanding commands\n",
+			count);
 }
 
 /* In case of device Error flag set, delay before reset is done in seconds */
@@ -4576,6 +8342,37 @@ static void sop_requeue_all_outstanding_io(struct sop_device *h)
 #define	MAX_RESET_COUNT			3
 
 /* Run time controller reset */
+/*
+ * Reset the PQI device and re-create its queues.  The outstanding I/O
+ * requests are left in place for sop_requeue_all_outstanding_io().
+ */
+static int sop_recreate_queues(struct sop_device *h)
+{
+	int rc;
+
+	rc = sop_init_time_host_reset(h);
+	if (rc)
+		return rc;
+
+	sop_reinit_all_ioq(h);
+
+	rc = sop_create_admin_queues(h);
+	if (rc)
+		return rc;
+
+	/* Complete all waiting Admin commands */
+	sop_timeout_queued_cmds(&h->qinfo[0], SOP_ERR_DEV_RESET);
+
+	/* Skip IO queue creation if IO queue was not ready */
+	if (!(h->flags & SOP_FLAGS_MASK_IOQ_RDY))
+		return 0;
+
+	dev_warn(&h->pdev->dev, "Re creating %d I/O queue pairs\n",
+		h->nr_queue_pairs-1);
+	/* Re create all the queue pairs */
+	return sop_create_io_queue_pairs(h);
+}
+
 static void sop_reset_controller(struct work_struct *work)
 {
 	int rc;
@@ -4586,46 +8383,39 @@ static void sop_reset_controller(struct work_struct *work)
 	h =  container_of(work, struct sop_device, dwork.work);
 
 start_reset:
+	/* A PCI error came in: the slot reset brings the queues back */
+	if (h->flags & SOP_FLAGS_MASK_PCI_ERR) {
+		clear_bit(SOP_FLAGS_BITPOS_RESET_PEND, &h->flags);
+		return;
+	}
 	dev_warn(&h->pdev->dev, "%s: Starting Reset\n", h->devname);
+	sop_scrub_cancel(h);
 	/* Skip reset if ADMIn queue was not ready */
 	if (!(h->flags & SOP_FLAGS_MASK_ADMIN_RDY))
 		goto end_reset;
 
-	rc = sop_init_time_host_reset(h);
-	if (rc)
-		goto reset_err;
-
-	sop_reinit_all_ioq(h);
-
-	rc = sop_create_admin_queues(h);
+	rc = sop_recreate_queues(h);
 	if (rc)
 		goto reset_err;
 
-	/* Complete all waiting Admin commands */
-	sop_timeout_queued_cmds(&h->qinfo[0], -1, SOP_ERR_DEV_RESET);
-
-	/* Skip IO queue creation if IO queue was not ready */
 	if (!(h->flags & SOP_FLAGS_MASK_IOQ_RDY)) {
 		clear_bit(SOP_FLAGS_BITPOS_RESET_PEND, &h->flags);
 		goto end_reset;
 	}
 
-	dev_warn(&h->pdev->dev, "Re creating %d I/O queue pairs\n",
-		h->nr_queue_pairs-1);
-	/* Re create all the queue pairs */
-	if (sop_create_io_queue_pairs(h) != 0)
-		goto reset_err;
-
 	dev_warn(&h->pdev->dev, "I/O queue created - Resubmitting pending commands\n");
 
 	clear_bit(SOP_FLAGS_BITPOS_RESET_PEND, &h->flags);
 
-	/* Requeue any pending I/O commands */
+	/* Replay any pending I/O commands */
 	sop_requeue_all_outstanding_io(h);
 
-	/* Now, need to revalidate the disk unconditionally */
+	/*
+	 * Now, need to revalidate the disk unconditionally, but without
+	 * holding up the I/O that was just replayed.
+	 */
 	clear_bit(SOP_FLAGS_BITPOS_REVALIDATE, &h->flags);
-	sop_revalidate(h->disk);
+	queue_work(h->wq, &h->revalidate_work);
 
 	/* Next: sop_resubmit_wait_list for all Q */
 	for (i = 1; i < h->nr_queue_pairs; i++)
@@ -4639,12 +8429,17 @@ reset_err:
 	reset_count++;
 	dev_warn(&h->pdev->dev, "Reset failed, attempt #%d of %d\n",
 			reset_count, MAX_RESET_COUNT);
-	if (reset_count < MAX_RESET_COUNT) {
+	if (reset_count < MAX_RESET_COUNT &&
+	    !(h->flags & SOP_FLAGS_MASK_PCI_ERR)) {
 		/* Delay before next reset issue */
 		usleep_range((SOP_ERROR_RESET_DELAY_SEC - 1) * 1000 * 1000,
 				(SOP_ERROR_RESET_DELAY_SEC + 1) * 1000 * 1000);
 		goto start_reset;
 	}
+	if (h->flags & SOP_FLAGS_MASK_PCI_ERR) {
+		clear_bit(SOP_FLAGS_BITPOS_RESET_PEND, &h->flags);
+		return;
+	}
 
 	/* Clear any capacity changed unit attn events pending */
 	clear_bit(SOP_FLAGS_BITPOS_REVALIDATE, &h->flags);
@@ -4681,30 +8476,66 @@ static void sop_revalidate_wq(struct work_struct *work)
 {
 	struct sop_device *h;
 
-	h =  container_of(work, struct sop_device, dwork.work);
+	h =  container_of(work, struct sop_device, revalidate_work);
 	sop_revalidate(h->disk);
 }
 
-static void sop_process_dev_timer(struct sop_device *h)
+/*
+ * Called every SOP_TMO_TICK_MS to turn the timeout wheels; the health
+ * check and the rest of the housekeeping only run on full_tick (1 sec).
+ */
+static void sop_tick_adminq(struct sop_device *h, int action)
+{
+	struct queue_info *q = &h->qinfo[0];
+	unsigned long flags;
+
+	if (!(h->flags & SOP_FLAGS_MASK_ADMIN_RDY))
+		return;
+
+	/*
+	 * Nothing else gives up on the admin commands of a reset: fail
+	 * them when they time out, so the reset does not wait forever.
+	 */
+	if (h->flags & (SOP_FLAGS_MASK_RESET_PEND | SOP_FLAGS_MASK_SLOT_RESET))
+		action = SOP_ERR_DEV_RESET;
+
+	/* Admin queue: ask the owner to poll and check timeouts */
+	atomic_set(&q->tick_action, action);
+	set_bit(SOP_OQ_BITPOS_POLL, &q->oq_flags);
+	set_bit(SOP_OQ_BITPOS_TICK, &q->oq_flags);
+	local_irq_save(flags);
+	sop_oq_service(q, sop_msix_handle_adminq);
+	local_irq_restore(flags);
+}
+
+static void sop_process_dev_timer(struct sop_device *h, bool full_tick)
 {
 	int i;
-	struct queue_info *q = &h->qinfo[0];
-	int action;
+	struct queue_info *q;
+	unsigned long flags;
+	int action = SOP_ERR_NONE;
+
+	/*
+	 * The link is being recovered: leave the I/O queues alone and keep
+	 * their wheels still so that in-flight commands do not time out.
+	 * Only the admin commands of a reset in progress keep timing out.
+	 */
+	if (h->flags & SOP_FLAGS_MASK_PCI_ERR) {
+		if (h->flags & (SOP_FLAGS_MASK_RESET_PEND |
+				SOP_FLAGS_MASK_SLOT_RESET))
+			sop_tick_adminq(h, SOP_ERR_DEV_RESET);
+		return;
+	}
 
 	/* Decide if there is any global error */
-	action = sop_device_error_state(h);
+	if (full_tick)
+		action = sop_device_error_state(h);
 	if (action == SOP_ERR_DEV_FAULT) {
 		dev_warn(&h->pdev->dev, "Detected HW issue! Will Reset...\n");
 		set_bit(SOP_FLAGS_BITPOS_DO_RESET, &h->flags);
 	}
 
-	if ((h->flags & SOP_FLAGS_MASK_ADMIN_RDY)) {
-		/* Admin queue */
-		spin_lock_irq(&q->oq->qlock);
-		sop_msix_handle_adminq(q);
-		sop_timeout_ios(&h->qinfo[0], action);
-		spin_unlock_irq(&q->oq->qlock);
-	}
+	sop_tick_adminq(h, action);
 
 	if ((h->flags & SOP_FLAGS_MASK_IOQ_RDY)) {
 		/* Io Queue */
@@ -4714,31 +8545,35 @@ static void sop_process_dev_timer(struct sop_device *h)
 			if (!q->oq)
 				continue;
 
-			spin_lock_irq(&q->oq->qlock);
+			/*
+			 * Process any pending ISR and handle errors.  If the
+			 * interrupt handler currently owns the queue it runs
+			 * both for us before letting go.
+			 */
+			atomic_set(&q->tick_action, action);
+			set_bit(SOP_OQ_BITPOS_POLL, &q->oq_flags);
+			set_bit(SOP_OQ_BITPOS_TICK, &q->oq_flags);
+			local_irq_save(flags);
+			sop_oq_service(q, sop_msix_handle_ioq);
+			local_irq_restore(flags);
+
+			if (SOP_DEVICE_BUSY(h))
+				continue;
 
-			/* Process any pending ISR */
-			sop_msix_handle_ioq(q);
+			/* react to cap changed unit attn. events */
+			if (full_tick && test_and_clear_bit(
+					SOP_FLAGS_BITPOS_REVALIDATE,
+					&h->flags))
+				queue_work(h->wq, &h->revalidate_work);
 
-			/* Handle errors */
-			sop_timeout_ios(q, action);
-			spin_unlock_irq(&q->oq->qlock);
-
-			if (!SOP_DEVICE_BUSY(h)) {
-				/* react to cap changed unit attn. events */
-				if (test_and_clear_bit(
-						SOP_FLAGS_BITPOS_REVALIDATE,
-						&h->flags)) {
-					PREPARE_DELAYED_WORK(&h->dwork,
-						sop_revalidate_wq);
-					schedule_delayed_work(&h->dwork, 0);
-				}
-
-				/* Process wait list commands */
-				sop_resubmit_wait_list(q, sop_process_bio);
-			}
+			/* Completions reaped above may have made room */
+			sop_kick_wait_list(q);
 		}
 	}
 
+	if (!full_tick)
+		return;
+
 	sop_process_driver_debug(h);
 
 	if ((h->flags & SOP_FLAGS_MASK_DO_RESET)) {
@@ -4758,28 +8593,53 @@ static void sop_process_dev_timer(struct sop_device *h)
 				"Scheduling a controller reset in %d sec\n",
 				(delay/HZ));
 			PREPARE_DELAYED_WORK(&h->dwork, sop_reset_controller);
-			schedule_delayed_work(&h->dwork, delay);
+			queue_delayed_work(h->wq, &h->dwork, delay);
 		}
 	}
 }
 
-static int sop_thread_proc(void *data)
+/* Pick an online CPU of the device's node, spreading devices over it */
+static int sop_timer_cpu(struct sop_device *h)
 {
-	struct sop_device *h;
+	int node = dev_to_node(&h->pdev->dev);
+	int cpu, ncpus = 0, skip;
 
-	set_freezable();
-	while (!kthread_freezable_should_stop(NULL)) {
-		__set_current_state(TASK_RUNNING);
-		spin_lock(&dev_list_lock);
-		list_for_each_entry(h, &dev_list, node)
-			sop_process_dev_timer(h);
-		spin_unlock(&dev_list_lock);
+	if (node < 0)
+		return -1;
 
-		set_current_state(TASK_INTERRUPTIBLE);
-		schedule_timeout(HZ);
-	}
+	for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+		ncpus++;
+	if (!ncpus)
+		return -1;
 
-	return 0;
+	skip = h->instance % ncpus;
+	for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+		if (skip-- == 0)
+			return cpu;
+
+	return -1;
+}
+
+static void sop_arm_timer(struct sop_device *h)
+{
+	unsigned long delay = msecs_to_jiffies(SOP_TMO_TICK_MS);
+	int cpu = sop_timer_cpu(h);
+
+	if (cpu < 0)
+		queue_delayed_work(h->wq, &h->timer_work, delay);
+	else
+		queue_delayed_work_on(cpu, h->wq, &h->timer_work, delay);
+}
+
+/* Per device housekeeping, runs every SOP_TMO_TICK_MS */
+static void sop_timer_wq(struct work_struct *work)
+{
+	struct sop_device *h = container_of(to_delayed_work(work),
+					struct sop_device, timer_work);
+
+	h->timer_ticks++;
+	sop_process_dev_timer(h, (h->timer_ticks % SOP_TMO_TICKS_PER_SEC) == 0);
+	sop_arm_timer(h);
 }
 
 static void sop_fail_all_outstanding_io(struct sop_device *h)
@@ -4792,11 +8652,13 @@ static void sop_fail_all_outstanding_io(struct sop_device *h)
 	dev_warn(&h->pdev->dev, "Aborting any pending commands\n");
 
 	if ((h->flags & SOP_FLAGS_MASK_ADMIN_RDY)) {
-		spin_lock_irq(&q->oq->qlock);
+		local_irq_disable();
+		sop_oq_claim(q);
 		/* Process any pending ISR */
 		sop_msix_handle_adminq(q);
-		sop_timeout_queued_cmds(&h->qinfo[0], -1, SOP_ERR_DEV_REM);
-		spin_unlock_irq(&q->oq->qlock);
+		sop_timeout_queued_cmds(&h->qinfo[0], SOP_ERR_DEV_REM);
+		sop_oq_release(q, sop_msix_handle_adminq);
+		local_irq_enable();
 	}
 
 	/* Io Queue */
@@ -4807,19 +8669,87 @@ static void sop_fail_all_outstanding_io(struct sop_device *h)
 			if (!q->oq)
 				continue;
 
-			spin_lock_irq(&q->oq->qlock);
+			local_irq_disable();
+			sop_oq_claim(q);
 			/* Process any pending ISR */
 			sop_msix_handle_ioq(q);
 			/* Fail all outstanding commands given to HW queue */
-			sop_timeout_queued_cmds(q, -1, SOP_ERR_DEV_REM);
-			spin_unlock_irq(&q->oq->qlock);
+			sop_timeout_queued_cmds(q, SOP_ERR_DEV_REM);
+			sop_oq_release(q, sop_msix_handle_ioq);
+			local_irq_enable();
 
 			/* Fail all commands waiting in internal queue */
+			hrtimer_cancel(&q->retry_timer);
+			hrtimer_cancel(&q->drain_timer);
+			sop_flush_retry_list(q);
 			sop_resubmit_wait_list(q, sop_fail_bio);
+			sop_fail_flush_wait(q);
 		}
 	}
 }
 
+/* Pass the device's internal block and transfer geometry on */
+static void sop_set_io_geometry(struct sop_device *h)
+{
+	struct request_queue *rq = h->rq;
+	unsigned int gran;
+
+	blk_queue_physical_block_size(rq, h->block_size << h->phys_block_exp);
+	blk_queue_alignment_offset(rq, h->lowest_aligned * h->block_size);
+	if (h->opt_xfer_gran)
+		blk_queue_io_min(rq, h->opt_xfer_gran * h->block_size);
+	if (h->opt_xfer_len)
+		blk_queue_io_opt(rq, h->opt_xfer_len * h->block_size);
+
+	/* Split on granularity boundaries only when it is stripe sized */
+	gran = h->opt_xfer_gran * (h->block_size >> 9);
+	h->split_sectors = ((gran << 9) >= SOP_SPLIT_MIN_BYTES) ? gran : 0;
+}
+
+/* Advertise discard only when the block limits page allows UNMAP */
+static void sop_set_discard_limits(struct sop_device *h)
+{
+	struct request_queue *rq = h->rq;
+	u32 max_desc;
+	u64 max_lba;
+
+	max_desc = min_t(u32, h->max_unmap_desc_count, SOP_UNMAP_MAX_DESC(h));
+	if (!h->max_unmap_lba_count || !max_desc) {
+		queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, rq);
+		rq->limits.max_discard_sectors = 0;
+		return;
+	}
+
+	/*
+	 * A discard bio must fit in one UNMAP and bi_size is 32 bits.  The
+	 * UNMAP limits count logical blocks, the block layer 512-byte sectors.
+	 */
+	max_lba = min_t(u64, h->max_unmap_lba_count,
+			(u64) max_desc * SOP_UNMAP_DESC_BLOCKS);
+	blk_queue_max_discard_sectors(rq, min_t(u64,
+			max_lba * (h->block_size >> 9), UINT_MAX >> 9));
+	rq->limits.discard_granularity = h->block_size *
+				max_t(u32, h->unmap_granularity, 1);
+	rq->limits.discard_alignment = h->block_size * h->unmap_alignment;
+	rq->limits.discard_zeroes_data = !!(h->lbp_flags & SOP_LBP_LBPRZ);
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, rq);
+}
+
+/* Offload zeroing (blkdev_issue_zeroout) to WRITE SAME(16) */
+static void sop_set_write_same_limits(struct sop_device *h)
+{
+	u64 max_blocks = h->max_write_same_blocks;
+
+	if (!max_blocks)
+		max_blocks = SOP_WS_DEFAULT_BLOCKS;
+	if (!h->capacity)
+		max_blocks = 0;
+	/* The VPD limit counts logical blocks, max_ws_sectors 512 bytes */
+	h->max_ws_sectors = min_t(u64, max_blocks * (h->block_size >> 9),
+				  UINT_MAX >> 9);
+	blk_queue_max_write_same_sectors(h->rq, h->max_ws_sectors);
+}
+
 static int sop_revalidate(struct gendisk *disk)
 {
 	struct sop_device *h;
@@ -4842,6 +8772,12 @@ static int sop_revalidate(struct gendisk *disk)
 	set_capacity(disk, h->capacity);
 	blk_queue_logical_block_size(h->rq, h->block_size);
 	blk_queue_max_hw_sectors(h->rq, h->max_hw_sectors);
+	/* The format may have changed, keep PI on only while it still can */
+	sop_set_integrity(h, h->pi_enabled);
+	sop_set_io_geometry(h);
+	sop_set_write_cache(h);
+	sop_set_discard_limits(h);
+	sop_set_write_same_limits(h);
 	return 0;
 }
 
@@ -4860,44 +8796,134 @@ static int sop_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 	return 0;
 }
 
+/*
+ * A controller reset would fight the slot reset over the queues.  Once
+ * PCI_ERR is set no new one is scheduled, and one that is running gives
+ * up at its next step.
+ */
+static void sop_pci_cancel_reset(struct sop_device *h)
+{
+	if (cancel_delayed_work_sync(&h->dwork))
+		clear_bit(SOP_FLAGS_BITPOS_RESET_PEND, &h->flags);
+}
+
+/* Hold off submission and the timeout wheels while the link recovers */
+static void sop_pci_quiesce(struct sop_device *h)
+{
+	int i;
+
+	if (test_and_set_bit(SOP_FLAGS_BITPOS_PCI_ERR, &h->flags))
+		return;
+	h->aer_start = jiffies;
+	sop_pci_cancel_reset(h);
+	sop_scrub_cancel(h);
+
+	/* Wait out submitters that got in before the flag was seen */
+	for (i = 1; i < h->nr_queue_pairs; i++) {
+		if (!h->qinfo[i].iq)
+			continue;
+		spin_lock_irq(&h->qinfo[i].iq->qlock);
+		spin_unlock_irq(&h->qinfo[i].iq->qlock);
+	}
+}
+
 static pci_ers_result_t sop_pci_error_detected(struct pci_dev *dev,
 				enum pci_channel_state error)
 {
-	dev_warn(&dev->dev,
-		"sop_pci_error_detected called but not implemented\n");
-	/* FIXME: implement this. */
-	return PCI_ERS_RESULT_NONE;
+	struct sop_device *h = pci_get_drvdata(dev);
+
+	dev_warn(&dev->dev, "PCI error detected, channel state %d\n",
+		(int) error);
+
+	switch (error) {
+	case pci_channel_io_normal:
+		/* Non fatal: MMIO still works, see sop_pci_mmio_enabled */
+		return PCI_ERS_RESULT_CAN_RECOVER;
+
+	case pci_channel_io_frozen:
+		sop_pci_quiesce(h);
+		return PCI_ERS_RESULT_NEED_RESET;
+
+	case pci_channel_io_perm_failure:
+	default:
+		set_bit(SOP_FLAGS_BITPOS_DO_REM, &h->flags);
+		set_bit(SOP_FLAGS_BITPOS_PCI_ERR, &h->flags);
+		sop_pci_cancel_reset(h);
+		clear_bit(SOP_FLAGS_BITPOS_PCI_ERR, &h->flags);
+		sop_scrub_cancel(h);
+		sop_fail_all_outstanding_io(h);
+		return PCI_ERS_RESULT_DISCONNECT;
+	}
 }
 
 static pci_ers_result_t sop_pci_mmio_enabled(struct pci_dev *dev)
 {
-	dev_warn(&dev->dev,
-		"sop_pci_error_mmio_enabled called but not implemented\n");
-	/* FIXME: implement this. */
-	return PCI_ERS_RESULT_NONE;
+	struct sop_device *h = pci_get_drvdata(dev);
+
+	if (sop_device_error_state(h) == SOP_ERR_NONE)
+		return PCI_ERS_RESULT_RECOVERED;
+
+	dev_warn(&dev->dev, "Device faulted after PCI error, resetting slot\n");
+	sop_pci_quiesce(h);
+	return PCI_ERS_RESULT_NEED_RESET;
 }
 
 static pci_ers_result_t sop_pci_link_reset(struct pci_dev *dev)
 {
-	dev_warn(&dev->dev,
-		"sop_pci_error_link_reset called but not implemented\n");
-	/* FIXME: implement this. */
-	return PCI_ERS_RESULT_NONE;
+	/* Everything is brought back in sop_pci_slot_reset */
+	return PCI_ERS_RESULT_RECOVERED;
 }
 
 static pci_ers_result_t sop_pci_slot_reset(struct pci_dev *dev)
 {
-	dev_warn(&dev->dev,
-		"sop_pci_error_slot_reset called but not implemented\n");
-	/* FIXME: implement this. */
-	return PCI_ERS_RESULT_NONE;
+	struct sop_device *h = pci_get_drvdata(dev);
+	int rc;
+
+	rc = pci_enable_device(dev);
+	if (rc) {
+		dev_err(&dev->dev, "Slot reset: Enable device failed\n");
+		goto slot_reset_fail;
+	}
+	pci_set_master(dev);
+	pci_restore_state(dev);
+	pci_save_state(dev);
+
+	set_bit(SOP_FLAGS_BITPOS_SLOT_RESET, &h->flags);
+	rc = sop_recreate_queues(h);
+	clear_bit(SOP_FLAGS_BITPOS_SLOT_RESET, &h->flags);
+	if (rc) {
+		dev_err(&dev->dev, "Slot reset: failed to re-create queues\n");
+		goto slot_reset_fail;
+	}
+	return PCI_ERS_RESULT_RECOVERED;
+
+slot_reset_fail:
+	set_bit(SOP_FLAGS_BITPOS_DO_REM, &h->flags);
+	clear_bit(SOP_FLAGS_BITPOS_PCI_ERR, &h->flags);
+	sop_fail_all_outstanding_io(h);
+	return PCI_ERS_RESULT_DISCONNECT;
 }
 
 static void sop_pci_resume(struct pci_dev *dev)
 {
-	dev_warn(&dev->dev, "sop_pci_resume called but not implemented\n");
-	/* FIXME: implement this. */
-	return;
+	struct sop_device *h = pci_get_drvdata(dev);
+	int i;
+
+	if (!(h->flags & SOP_FLAGS_MASK_PCI_ERR))
+		return;
+
+	/* Replay what was in flight before anything new goes out */
+	sop_requeue_all_outstanding_io(h);
+	clear_bit(SOP_FLAGS_BITPOS_PCI_ERR, &h->flags);
+
+	h->aer_recoveries++;
+	h->aer_last_msecs = jiffies_to_msecs(jiffies - h->aer_start);
+	dev_warn(&dev->dev, "Recovered from PCI error in %u ms\n",
+		h->aer_last_msecs);
+
+	queue_work(h->wq, &h->revalidate_work);
+	for (i = 1; i < h->nr_queue_pairs; i++)
+		sop_kick_wait_list(&h->qinfo[i]);
 }
 
 /* This gets optimized away, but will fail to compile if we mess up
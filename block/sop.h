@@ -22,11 +22,19 @@
  *
  */
 
+#include "sop_ioctl.h"
+
 #define MAX_SGLS	(128)
 #define MAX_IO_CMDS	(2048)
 #define MAX_ADMIN_CMDS	(64)
 #define MAX_CMDS	(1024)
 #define MAX_CMDS_LOW	(64)
+#define MAX_MGMT_CMDS	(32)
+/* Management requests only lock operations (COMPARE AND WRITE) may use */
+#define SOP_MGMT_LOCK_RESERVE	(4)
+
+/* How often an SG_IO waiting for a management queue slot re-checks */
+#define SOP_MGMT_WAIT_MS	(10)
 
 /* #define	SOP_SUPPORT_BIO_LOG	1 */
 /* #define	SOP_IO_COUNTERS */
@@ -307,17 +315,41 @@ struct pqi_device_capabilities {
 #define DRIVER_MAX_IQ_NELEMENTS MAX_CMDS
 #define DRIVER_MAX_OQ_NELEMENTS MAX_CMDS
 
-/* Note: Value below is stored in u16 */
-#define	MAX_SOP_TIMEOUT		64
 #define	DEF_IO_TIMEOUT		30
-#define INVALID_TIMEOUT		0xFFFF
+#define	SOP_TMF_TIMEOUT		10
+#define	SOP_TMF_WAIT		(2 * SOP_TMF_TIMEOUT)	/* before giving up */
 
 #define MAX_RETRY_COUNT		3
 
+/*
+ * Per queue hierarchical timing wheel.  Level 0 has one bucket per tick,
+ * level 1 one bucket per SOP_TMO_WHEEL_SIZE ticks and is cascaded into
+ * level 0 as the wheel turns.  Requests are linked into the bucket of
+ * their deadline so that a tick only touches requests that expire.
+ */
+#define SOP_TMO_TICK_MS		100
+#define SOP_TMO_TICKS_PER_SEC	(MSEC_PER_SEC / SOP_TMO_TICK_MS)
+#define SOP_TMO_WHEEL_BITS	6
+#define SOP_TMO_WHEEL_SIZE	(1 << SOP_TMO_WHEEL_BITS)
+#define SOP_TMO_WHEEL_MASK	(SOP_TMO_WHEEL_SIZE - 1)
+#define SOP_TMO_WHEEL_LEVELS	2
+#define SOP_TMO_MAX_TICKS	((SOP_TMO_WHEEL_SIZE - 1) * SOP_TMO_WHEEL_SIZE)
+#define SOP_TMO_MAX_MS		(SOP_TMO_MAX_TICKS * SOP_TMO_TICK_MS)
+
 struct sop_timeout {
-	atomic_t time_slot[MAX_SOP_TIMEOUT];
-	atomic_t cur_slot;
+	spinlock_t lock;
+	unsigned long cur_tick;
+	struct list_head wheel[SOP_TMO_WHEEL_LEVELS][SOP_TMO_WHEEL_SIZE];
+};
+
+/* A run of bios that entered the wait list at the same time */
+struct sop_wait_run {
+	u64 enq_ns;
+	u32 count;
 };
+#define SOP_WAIT_RUNS		32
+#define SOP_WAIT_HIST_BUCKETS	24	/* log2(usec) */
+#define SOP_DRAIN_DELAY_US	250
 
 struct sop_device;
 struct pqi_sgl_descriptor;
@@ -337,8 +369,66 @@ struct queue_info {
 	struct pqi_device_queue *oq;
 	struct bio_list wait_list;
 	struct sop_timeout tmo;
+
+	/*
+	 * The outbound queue is serviced by exactly one context at a time
+	 * (its interrupt handler or whoever polls it).  Other contexts do
+	 * not wait for it: they set a request bit and the current owner
+	 * picks the request up before it gives up ownership.
+	 */
+#define SOP_OQ_BITPOS_OWNED	0
+#define SOP_OQ_BITPOS_POLL	1
+#define SOP_OQ_BITPOS_TICK	2
+#define SOP_OQ_MASK_POLL	(1 << SOP_OQ_BITPOS_POLL)
+#define SOP_OQ_MASK_TICK	(1 << SOP_OQ_BITPOS_TICK)
+	unsigned long oq_flags;
+	atomic_t tick_action;
+
+	/*
+	 * Bios the device asked us to retry are parked on retry_list until
+	 * retry_timer moves them to the wait list.  Both, and the backoff,
+	 * are protected by iq->qlock.  depth_limit is the AIMD window of
+	 * commands kept outstanding and is only written by the OQ owner.
+	 */
+	struct bio_list retry_list;
+	struct hrtimer retry_timer;
+	u32 retry_backoff_us;
+	u8 retry_armed;
+	u16 depth_limit;
+	u16 depth_credit;
+
+	/*
+	 * wait_runs mirrors wait_list as a FIFO of runs so that the time
+	 * each bio spent waiting can go into wait_hist when it leaves.
+	 * drain_timer is the safety net for a parked bio that no
+	 * completion will come to pick up.  All under iq->qlock.
+	 */
+	struct sop_wait_run wait_runs[SOP_WAIT_RUNS];
+	u16 wait_run_head;
+	u16 wait_run_cnt;
+	u32 wait_hist[SOP_WAIT_HIST_BUCKETS];
+	struct hrtimer drain_timer;
+	u8 drain_armed;
+
+	/*
+	 * At most one SYNCHRONIZE CACHE in flight per queue.  Flushes that
+	 * arrive meanwhile gather on flush_wait and all ride the next one.
+	 * Under iq->qlock.
+	 */
+	struct bio_list flush_wait;
+	u8 flush_busy;
+};
+
+/* Stands in for a bio the device asked us to retry */
+struct sop_retry_bio {
+	struct bio *orig;
+	u8 retries;
 };
 
+#define SOP_RETRY_MIN_BACKOFF_US	100
+#define SOP_RETRY_MAX_BACKOFF_US	100000
+#define SOP_MIN_DEPTH_LIMIT		1
+
 struct pqi_device_capability_info {
 	/* cached data about PQI device limits */
 	u16 max_iqs;
@@ -371,12 +461,16 @@ struct sop_device {
 #define SOP_FLAGS_BITPOS_DO_RESET	0
 #define SOP_FLAGS_BITPOS_DO_REM		1
 #define SOP_FLAGS_BITPOS_RESET_PEND	2
+#define SOP_FLAGS_BITPOS_PCI_ERR	3
+#define SOP_FLAGS_BITPOS_SLOT_RESET	4
 #define SOP_FLAGS_BITPOS_ADMIN_RDY	8
 #define SOP_FLAGS_BITPOS_IOQ_RDY	9
 #define SOP_FLAGS_BITPOS_REVALIDATE	10
 #define SOP_FLAGS_MASK_DO_RESET		(1 << SOP_FLAGS_BITPOS_DO_RESET)
 #define SOP_FLAGS_MASK_DO_REM		(1 << SOP_FLAGS_BITPOS_DO_REM)
 #define SOP_FLAGS_MASK_RESET_PEND	(1 << SOP_FLAGS_BITPOS_RESET_PEND)
+#define SOP_FLAGS_MASK_PCI_ERR		(1 << SOP_FLAGS_BITPOS_PCI_ERR)
+#define SOP_FLAGS_MASK_SLOT_RESET	(1 << SOP_FLAGS_BITPOS_SLOT_RESET)
 #define SOP_FLAGS_MASK_ADMIN_RDY	(1 << SOP_FLAGS_BITPOS_ADMIN_RDY)
 #define SOP_FLAGS_MASK_IOQ_RDY		(1 << SOP_FLAGS_BITPOS_IOQ_RDY)
 #define SOP_FLAGS_MASK_REVALIDATE	(1 << SOP_FLAGS_BITPOS_REVALIDATE)
@@ -390,6 +484,19 @@ struct sop_device {
 	int intr_mode;
 #define	SOP_MAXNAME_LEN	16
 	char devname[SOP_MAXNAME_LEN];
+	char ptname[SOP_MAXNAME_LEN];
+	struct miscdevice ptdev;	/* asynchronous passthrough node */
+
+	/*
+	 * Files open on ptdev.  The file operations that reach the device
+	 * hold pt_rwsem shared, remove takes it to mark them dead.  pt_mutex
+	 * guards pt_files and what the files still have DMA mapped.  ref
+	 * keeps the sop_device around until the last of them is closed.
+	 */
+	struct rw_semaphore pt_rwsem;
+	struct mutex pt_mutex;
+	struct list_head pt_files;
+	struct kref ref;
 	int ctlr;
 	struct pqi_device_queue *io_q_to_dev;
 	struct pqi_device_queue *io_q_from_dev;
@@ -419,32 +526,104 @@ struct sop_device {
 #define qinfo_to_qid(qinfo) (qpindex_from_pqiq(qinfo->oq))
 #define qpindex_to_qid(qpindex, to_device) (qpindex)
 	int instance;
+	struct workqueue_struct *wq;
 	struct delayed_work dwork;
+	struct delayed_work timer_work;
+	unsigned int timer_ticks;
+
+	/* Timed out commands waiting for an abort or LUN reset */
+	struct list_head recovery_list;
+	spinlock_t recovery_lock;
+	struct work_struct recovery_work;
+
+	/* Disk parameters are re-read off the I/O path */
+	struct work_struct revalidate_work;
+
+	/* Background VERIFY of the media, driven from the scrub attribute */
+	struct delayed_work scrub_work;
+	spinlock_t scrub_lock;
+	u8 scrub_running;
+	u64 scrub_next;		/* next LBA to verify */
+	u64 scrub_end;
+	u32 scrub_rate;		/* MB/s, 0 for no limit */
+	u32 scrub_nbad;
+	u32 scrub_dropped;	/* bad ranges that did not fit below */
+#define SOP_SCRUB_MAX_BAD	16
+	struct sop_scrub_range {
+		u64 lba;
+		u32 nblocks;
+	} scrub_bad[SOP_SCRUB_MAX_BAD];
+
+	/* GROUP NUMBER for writes by LBA range, see write_groups attr */
+	spinlock_t wgroup_lock;
+	u32 nr_wgroups;
+#define SOP_MAX_WRITE_GROUPS	8
+	struct sop_write_group {
+		u64 lba;
+		u64 nblocks;
+		u8 group;
+	} wgroup[SOP_MAX_WRITE_GROUPS];
+
+	/* PCI error recovery */
+	unsigned long aer_start;	/* jiffies when the error was seen */
+	u32 aer_recoveries;
+	u32 aer_last_msecs;
+
+	/* All-zero writes sent as WRITE SAME, see the zero_detect attr */
+	atomic_t zero_writes;
+	atomic64_t zero_bytes_elided;
+
 	sector_t capacity;
 	int block_size;
+	u8 phys_block_exp;	/* log2 logical blocks per physical block */
+	u16 lowest_aligned;
+	u32 opt_xfer_gran;	/* blocks, from the block limits VPD page */
+	u32 opt_xfer_len;
+	unsigned int split_sectors;	/* no command crosses these, 0 off */
+	u8 wce;			/* volatile write cache enabled */
+	u8 dpofua;		/* device honours FUA */
 	struct request_queue *rq;
 	struct gendisk *disk;
 	u32 max_hw_sectors;
+	/* From the block limits VPD page, 0 count means no UNMAP */
+	u32 max_unmap_lba_count;
+	u32 max_unmap_desc_count;
+	u32 unmap_granularity;
+	u32 unmap_alignment;
+	u64 max_write_same_blocks;
+	u8 max_caw_blocks;	/* 0 when COMPARE AND WRITE is not offered */
+	u32 max_atomic_blocks;	/* 0 when WRITE ATOMIC is not offered */
+	u32 atomic_alignment;
+	u32 atomic_granularity;
+	u8 prot_type;		/* T10 PI type of the media, 0 for none */
+	u8 pi_enabled;		/* PI travels with the data, see integrity */
+	u32 max_ws_sectors;	/* 0 when WRITE SAME is not offered */
+	u8 lbp_flags;		/* byte 5 of the provisioning VPD page */
+	u8 group_sup;		/* honours the CDB GROUP NUMBER field */
+	u8 tpc;			/* takes ROD tokens, cleared once refused */
+	atomic_t copy_list_id;
 	int elements_per_io_queue;
 	int max_sgls;
 	struct pqi_device_capability_info devcap;
 
-	/* Next two fields are for dealing with REQ_FLUSH with data
-	 * We can get away with just enough to track only a single such
-	 * bio because there can only be one such bio active
-	 * at a time (see "C1" comment in block/blk-flush.c 
-	 */
-	struct bio *req_flush_bio;
-	int sync_cache_done;
-
 	struct sop_request_pool admin_req;
 	struct sop_request_pool *io_req;
 	int num_io_req_pool;
+
+	/*
+	 * SG_IO and internal commands use a queue pair and request pool of
+	 * their own so they never take tags from the data queues.  A zero
+	 * mgmt_qpindex means there were too few queues to spare one.
+	 */
+	int mgmt_qpindex;
+	struct sop_request_pool mgmt_req;
+	wait_queue_head_t mgmt_wait;
 };
 
 #define	SOP_DEVICE_BUSY(_h)	(((_h)->flags) & (\
 					SOP_FLAGS_MASK_DO_RESET | \
-					SOP_FLAGS_MASK_RESET_PEND))
+					SOP_FLAGS_MASK_RESET_PEND | \
+					SOP_FLAGS_MASK_PCI_ERR))
 #define	SOP_DEVICE_REM(_h)	(((_h)->flags) & SOP_FLAGS_MASK_DO_REM)
 #define	SOP_DEVICE_READY(_h)	(((_h)->flags & SOP_FLAGS_MASK_ADMIN_RDY) && \
 					((_h)->flags & SOP_FLAGS_MASK_IOQ_RDY))
@@ -453,19 +632,33 @@ struct sop_device {
 #pragma pack()
 
 #define MAX_RESPONSE_SIZE 64
+struct sop_pt_req;
 struct sop_request {
 	struct completion *waiting;
 	struct bio *bio;
+	struct sop_pt_req *pt;	/* asynchronous passthrough command */
 	struct scatterlist *sgl;
 	u32 xfer_size;
 	u16 response_accumulated;
 	u16 request_id;
 	u8 num_sg;
 	u8 retry_count;
-	u16 tmo_slot;
+	u8 tag_hold;		/* tag kept while an abort may name it */
+	u8 tag_freed;		/* freed meanwhile, sop_release_tag() frees */
+	u8 tmo_stage;		/* recovery step taken after a timeout */
+#define SOP_TMO_NONE		0
+#define SOP_TMO_ABORT		1
+#define SOP_TMO_LUN_RESET	2
+#define SOP_TMO_TMF		3	/* the request is a TMF itself */
 	u16 qid;
+	struct list_head recovery_entry;	/* on h->recovery_list */
+	struct list_head tmo_entry;	/* on qinfo->tmo wheel while pending */
+	unsigned long tmo_deadline;	/* in qinfo->tmo ticks */
 	u16 log_index;		/* Used for log only - reserved otherwise */
 	unsigned long start_time;
+	u8 flush;		/* a SYNCHRONIZE CACHE for bio and riders */
+	struct bio_list flush_riders;	/* other flushes it releases */
+	u8 iu[IQ_IU_SIZE];	/* copy of the posted IU, replayed on reset */
 	u8 response[MAX_RESPONSE_SIZE];
 };
 
@@ -473,7 +666,7 @@ struct sop_sync_cdb_req {
 	/* input parameters */
 	unsigned char cdb[16];
 	u8 cdblen;
-	u8 timeout;
+	u32 timeout_ms;
 	struct iovec *iov;
 	int iov_count;
 	int data_len;
@@ -482,6 +675,13 @@ struct sop_sync_cdb_req {
 	/* field for partial issue */
 	int iovec_idx;
 
+	/* already DMA mapped buffer, for SG_FLAG_MMAP_IO */
+	struct scatterlist *rsv_sgl;
+	int rsv_nsegs;
+
+	/* may take the requests kept for lock operations */
+	u8 lock_op;
+
 	/* return value */
 	u8 scsi_status;
 	u8 sense_key;
@@ -489,6 +689,56 @@ struct sop_sync_cdb_req {
 	sg_io_hdr_t *sg_hdr;
 };
 
+struct sop_pt_regbuf {
+	struct page **pages;
+	int npages;
+	struct scatterlist *sgl;	/* one entry per contiguous run */
+	int nchunks;
+	int nmapped;
+	u64 len;
+	atomic_t users;			/* commands posted against it */
+};
+
+struct sop_pt_file;
+struct sop_pt_req {
+	struct list_head entry;		/* on the file's free or done list */
+	struct sop_pt_file *f;
+	struct sop_pt_regbuf *rb;	/* registered buffer in use, if any */
+	struct scatterlist *sgl;
+	struct page **page_map;
+	int nsegs;
+	int dma_dir;
+	struct sop_pt_cpl cpl;
+};
+
+struct sop_pt_file {
+	struct sop_device *h;
+	struct list_head node;		/* on h->pt_files */
+	int dead;			/* the device is gone */
+	spinlock_t lock;
+	struct list_head free;
+	struct list_head done;		/* completed, not read yet */
+	int pending;			/* posted to the device */
+	wait_queue_head_t wait;
+
+	/*
+	 * Reserved buffer userspace mmaps for SG_FLAG_MMAP_IO: allocated
+	 * and DMA mapped once, on the first mmap of the file.
+	 */
+	struct mutex rsv_lock;
+	struct scatterlist *rsv_sgl;
+	int rsv_nchunks;
+	int rsv_nmapped;
+	unsigned long rsv_size;
+
+	/* Registered buffers, slots are claimed and released under lock */
+#define SOP_PT_MAX_REGBUF	16
+	struct sop_pt_regbuf regbuf[SOP_PT_MAX_REGBUF];
+
+#define SOP_PT_DEPTH		64	/* commands in flight per open file */
+	struct sop_pt_req req[SOP_PT_DEPTH];
+};
+
 #pragma pack(1)
 struct sop_limited_cmd_iu {
 	u8 iu_type;
@@ -511,6 +761,31 @@ struct sop_limited_cmd_iu {
 };
 #pragma pack()
 
+/* T10 protection information, one per logical block */
+#pragma pack(1)
+struct sop_dif_tuple {
+	__be16 guard_tag;
+	__be16 app_tag;
+	__be32 ref_tag;
+};
+#pragma pack()
+
+/* UNMAP parameter list, all fields big endian */
+#pragma pack(1)
+struct sop_unmap_blk_desc {
+	u64 lba;
+	u32 nblocks;
+	u32 reserved;
+};
+
+struct sop_unmap_param_list {
+	u16 data_len;
+	u16 blk_desc_len;
+	u32 reserved;
+	struct sop_unmap_blk_desc desc[0];
+};
+#pragma pack()
+
 #define SOP_RESPONSE_CMD_SUCCESS_IU_TYPE 0x90
 #define SOP_RESPONSE_CMD_RESPONSE_IU_TYPE 0x91
 #define SOP_RESPONSE_TASK_MGMT_RESPONSE_IU_TYPE 0x93
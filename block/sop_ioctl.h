@@ -0,0 +1,121 @@
+#ifndef _SOP_IOCTL_H
+#define _SOP_IOCTL_H
+/*
+ *    SCSI over PCI (SOP) driver - user interface
+ *    Copyright 2012 Hewlett-Packard Development Company, L.P.
+ *    Copyright 2012 SanDisk Inc.
+ *
+ *    This program is licensed under the GNU General Public License
+ *    version 2
+ *
+ *    This program is distributed "as is" and WITHOUT ANY WARRANTY
+ *    of any kind whatsoever, including without limitation the implied
+ *    warranty of MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.
+ *    Please see the GNU General Public License v.2 at
+ *    http://www.gnu.org/licenses/licenses.en.html for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *    Questions/Comments/Bugfixes to iss_storagedev@hp.com
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Asynchronous passthrough: an array of sop_pt_cmd written to the
+ * passthrough node is posted without waiting, completions are read
+ * back as an array of sop_pt_cpl in whatever order they finished.
+ */
+struct sop_pt_cmd {
+	__u64 tag;		/* handed back in the completion */
+	__u64 buf;		/* user buffer */
+	__u32 len;
+	__u32 timeout_ms;	/* 0 means the default I/O timeout */
+	__u8 dir;
+#define SOP_PT_DIR_NONE		0
+#define SOP_PT_DIR_FROM_DEV	1
+#define SOP_PT_DIR_TO_DEV	2
+	__u8 cdb_len;
+	__u8 flags;
+#define SOP_PT_FLAG_REG_BUF	0x01	/* buf is an offset into buf_index */
+	__u8 reserved1;
+	__u16 buf_index;
+	__u8 reserved2[2];
+	__u8 cdb[16];
+};
+
+struct sop_pt_cpl {
+	__u64 tag;
+	__s32 result;		/* 0 or -errno if the command did not complete */
+	__u32 resid;
+	__u8 status;		/* SCSI status */
+	__u8 sense_len;
+	__u8 reserved[6];
+#define SOP_PT_SENSE_LEN	32
+	__u8 sense[SOP_PT_SENSE_LEN];
+};
+
+/* Pin, map and coalesce a user buffer once for many commands */
+struct sop_pt_buf_reg {
+	__u64 addr;
+	__u64 len;
+	__u32 index;		/* returned, goes in sop_pt_cmd.buf_index */
+	__u32 reserved;
+};
+#define SOP_PT_IOC_REGISTER	_IOWR('s', 0x01, struct sop_pt_buf_reg)
+#define SOP_PT_IOC_UNREGISTER	_IOW('s', 0x02, __u32)
+
+/*
+ * Copy nr_sectors from src_sector to dst_sector of the opened disk or
+ * partition inside the device.  Sectors are 512 bytes and the ranges
+ * must start and end on logical block boundaries.  Dirty source pages
+ * are written back first, cached destination pages dropped after.
+ */
+struct sop_copy_range {
+	__u64 src_sector;
+	__u64 dst_sector;
+	__u64 nr_sectors;
+	__u32 flags;
+#define SOP_COPY_NO_FALLBACK	0x01	/* fail rather than copy via host */
+	__u32 offloaded;	/* returned, 1 if the device moved it all */
+};
+#define SOP_IOC_COPY		_IOWR('s', 0x03, struct sop_copy_range)
+
+/*
+ * COMPARE AND WRITE: if nr_sectors at sector still hold what compare
+ * points to, replace them with what write points to, atomically.
+ * 512-byte sectors, covering whole logical blocks.
+ */
+struct sop_compare_write {
+	__u64 sector;
+	__u64 compare;		/* user buffers of nr_sectors each */
+	__u64 write;
+	__u32 nr_sectors;
+	__u16 flags;
+#define SOP_CAW_FUA		0x01
+	__u8 miscompare;	/* returned, 1 if nothing was written */
+	__u8 reserved;
+};
+#define SOP_IOC_COMPARE_WRITE	_IOWR('s', 0x04, struct sop_compare_write)
+
+/*
+ * Write nr_sectors at sector from buf with WRITE ATOMIC(16): after a
+ * crash either all of it or none of it is on the media.  512-byte
+ * sectors, covering whole logical blocks; the limits are in the
+ * atomic_write_* attributes of the PCI device.
+ */
+struct sop_atomic_write {
+	__u64 sector;
+	__u64 buf;
+	__u32 nr_sectors;
+	__u16 flags;
+#define SOP_ATOMIC_FUA		0x01
+	__u16 reserved;
+};
+#define SOP_IOC_ATOMIC_WRITE	_IOW('s', 0x05, struct sop_atomic_write)
+
+#endif /* _SOP_IOCTL_H */
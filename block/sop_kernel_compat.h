@@ -46,16 +46,34 @@ void usleep_range(unsigned long min, unsigned long max)
 #define MRFN_RET
 #endif
 
+/* alloc_workqueue() takes a format string since 3.3 */
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 3, 0))
-bool kthread_freezable_should_stop(bool *was_frozen)
-{
-	might_sleep();
+#define sop_alloc_workqueue(name, flags, max_active) \
+	alloc_workqueue(name, flags, max_active)
+#else
+#define sop_alloc_workqueue(name, flags, max_active) \
+	alloc_workqueue("%s", flags, max_active, name)
+#endif
 
-	if (unlikely(freezing(current)))
-		refrigerator();
+/* WRITE SAME bios showed up in 3.7 */
+#ifndef REQ_WRITE_SAME
+#define REQ_WRITE_SAME	0
+#define blk_queue_max_write_same_sectors(q, max)	do { } while (0)
+#endif
 
-	return kthread_should_stop();
-}
+/* SERVICE_ACTION_IN became SERVICE_ACTION_IN_16 in 3.19 */
+#ifndef SERVICE_ACTION_IN_16
+#define SERVICE_ACTION_IN_16	SERVICE_ACTION_IN
+#endif
+
+/* COMPARE_AND_WRITE was only named in 3.12 */
+#ifndef COMPARE_AND_WRITE
+#define COMPARE_AND_WRITE	0x89
+#endif
+
+/* renamed in 3.16 and the old name dropped later on */
+#ifndef smp_mb__after_clear_bit
+#define smp_mb__after_clear_bit()	smp_mb__after_atomic()
 #endif
 
 /* these next three disappeared in 3.8-rc4 */